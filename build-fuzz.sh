@@ -0,0 +1,5 @@
+CC=clang
+
+# libFuzzer provides main(), and main.c stands in for the OS layer
+$CC main.c -o 6502-fuzz -DFUZZ -g -O1 -Wall -pthread \
+	-fsanitize=fuzzer,address,undefined
@@ -10,5 +10,5 @@ DYN_LIBRARIES="-lxkbcommon-x11 -lxkbcommon"
 FLAGS=$([[ "$1" == "release" ]] && echo "-Os -flto" || echo "-g")
 echo "Building with flags: $FLAGS"
 
-$CC main.c linux.c -o 6502 $FLAGS -Wall -I$INCLUDES $LIBRARIES\
+$CC main.c linux.c -o 6502 $FLAGS -Wall -pthread -I$INCLUDES $LIBRARIES\
 	-L$DYN_LIBRARY_PATH $DYN_LIBRARIES
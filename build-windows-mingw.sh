@@ -6,4 +6,4 @@ LIBRARIES="\
 FLAGS=$([[ "$1" == "release" ]] && echo "-Os -flto" || echo "-g")
 echo "Building with flags: $FLAGS"
 
-$CC main.c windows.c -o 6502.exe $FLAGS -Wall -static -mwindows $LIBRARIES
+$CC main.c windows.c -o 6502.exe $FLAGS -Wall -pthread -static -mwindows $LIBRARIES
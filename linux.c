@@ -22,14 +22,31 @@
 #include <xkbcommon/xkbcommon-x11.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define EVENT_QUEUE_LENGTH 64
 
 xcb_connection_t *connection = NULL;
 xcb_screen_t *screen = NULL;
 xcb_window_t window = 0; 
 xcb_intern_atom_reply_t *del_win_rep = NULL;
-bool should_exit = false;
+atomic_bool should_exit = false;
 xcb_gcontext_t *xcb_colors = NULL;
-struct xkb_state *keyboard_state;
+struct xkb_state *keyboard_state = NULL; // Only touched by the event thread
+
+// Events translated by the event thread, waiting for main.c
+pthread_t event_thread;
+pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER; // Queue has room again
+struct event event_queue[EVENT_QUEUE_LENGTH];
+int event_head = 0;
+atomic_int event_count = 0; // Written under lock, peeked without
+bool wake_requested = false; // os_wake, under lock
+
+void *event_thread_main(void*);
 
 int main(int argc, char **argv) {
 	return our_main(argc, argv);
@@ -54,35 +71,37 @@ void os_create_window(const char *name, int width, int height) {
 			XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, masks, values);
 	}
 	xcb_map_window(connection, window);
+
+	// Ask for both atoms before waiting on either, so that's one round trip
+	xcb_intern_atom_cookie_t protocol_cookie =
+		xcb_intern_atom(connection, 1, 12, "WM_PROTOCOLS");
+	xcb_intern_atom_cookie_t del_win_cookie =
+		xcb_intern_atom(connection, 0, 16, "WM_DELETE_WINDOW");
 	xcb_flush(connection);
-	
+
 	// Register for "delete window" event from window manager
 	xcb_intern_atom_reply_t *protocol_rep = xcb_intern_atom_reply(
-		connection, xcb_intern_atom(connection, 1, 12, "WM_PROTOCOLS"), 0);
-	del_win_rep = xcb_intern_atom_reply(
-		connection, xcb_intern_atom(connection, 0, 16, "WM_DELETE_WINDOW"), 0);
+		connection, protocol_cookie, 0);
+	del_win_rep = xcb_intern_atom_reply(connection, del_win_cookie, 0);
 	xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window,
 		(*protocol_rep).atom, 4, 32, 1, &(*del_win_rep).atom);
+	free(protocol_rep);
 
-	// Get keyboard keymap and state
-	{
-		// FIXME: Need free
-		xkb_x11_setup_xkb_extension(connection, XKB_X11_MIN_MAJOR_XKB_VERSION,
-			XKB_X11_MIN_MINOR_XKB_VERSION, 0, NULL, NULL, NULL, NULL);
-		struct xkb_context *xkb_context =
-			xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-		uint32_t keyboard_device = 
-			xkb_x11_get_core_keyboard_device_id(connection);
-		struct xkb_keymap *keymap = xkb_x11_keymap_new_from_device(xkb_context,
-			connection, keyboard_device, XKB_KEYMAP_COMPILE_NO_FLAGS);
-		keyboard_state = xkb_x11_state_new_from_device(keymap, connection,
-			keyboard_device);
-	}
+	// The keymap is fetched on the first key, by the event thread, so
+	// startup doesn't wait on it
+
+	// Receive events on their own thread so they reach main.c immediately
+	pthread_create(&event_thread, NULL, event_thread_main, NULL);
 }
 
 uint16_t ftoi16(float f) { return (uint16_t) (f * 65535); }
 void os_create_colormap(const float *rgb, int length) {
 	xcb_colors = malloc(length * sizeof(xcb_gcontext_t));
+
+	// Ask for every color first, then collect the answers, so that's one
+	// round trip instead of one per color
+	xcb_alloc_color_cookie_t *cookies =
+		malloc(length * sizeof(xcb_alloc_color_cookie_t));
 	for (int i = 0; i < length; i++) {
 		// Get color from list
 		float r = rgb[i * 3 + 0];
@@ -90,18 +109,22 @@ void os_create_colormap(const float *rgb, int length) {
 		float b = rgb[i * 3 + 2];
 
 		// Get color from colormap
+		cookies[i] = xcb_alloc_color(connection, screen->default_colormap,
+			ftoi16(r), ftoi16(g), ftoi16(b));
+	}
+	for (int i = 0; i < length; i++) {
 		xcb_alloc_color_reply_t *rep = xcb_alloc_color_reply(connection,
-			xcb_alloc_color(connection, screen->default_colormap,
-				ftoi16(r), ftoi16(g), ftoi16(b)),
-			NULL);
+			cookies[i], NULL);
 
 		// Create context from color
 		xcb_gcontext_t gc = xcb_generate_id(connection);
-		uint32_t value[] = { rep->pixel };
+		uint32_t value[] = { rep ? rep->pixel : screen->white_pixel };
 		xcb_create_gc(connection, gc, window, XCB_GC_FOREGROUND, value);
 		xcb_colors[i] = gc;
 		free(rep);
 	}
+	free(cookies);
+	xcb_flush(connection);
 }
 
 bool os_choose_bin(char* path, int pathLength) {
@@ -109,68 +132,161 @@ bool os_choose_bin(char* path, int pathLength) {
 }
 
 bool os_should_exit(void) {
-	return should_exit; // Set in poll event
+	return should_exit; // Set in event thread
 }
 
-bool os_poll_event(struct event *ev) {
-	xcb_generic_event_t *event = xcb_poll_for_event(connection);
+unsigned long long clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Gets keyboard keymap and state, the first time a key needs them
+void load_keymap(void) {
+	// FIXME: Need free
+	xkb_x11_setup_xkb_extension(connection, XKB_X11_MIN_MAJOR_XKB_VERSION,
+		XKB_X11_MIN_MINOR_XKB_VERSION, 0, NULL, NULL, NULL, NULL);
+	struct xkb_context *xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	uint32_t keyboard_device =
+		xkb_x11_get_core_keyboard_device_id(connection);
+	struct xkb_keymap *keymap = xkb_x11_keymap_new_from_device(xkb_context,
+		connection, keyboard_device, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	keyboard_state = xkb_x11_state_new_from_device(keymap, connection,
+		keyboard_device);
+}
+
+// Turns an XCB event into a main.c event. Returns false if main.c
+// doesn't need to know about it.
+bool translate_event(xcb_generic_event_t *event, struct event *ev) {
 	bool found_event = false;
-	if (event) {
-		//printf("XCB Event %d\n", event->response_type);
-		switch (event->response_type & ~0x80) {
-			// Detect exiting
-			case XCB_CLIENT_MESSAGE:
-				if (((xcb_client_message_event_t*)event)->data.data32[0]
-					== del_win_rep->atom) {
-					should_exit = true;
-				}
-				found_event = false; // Event not processed by main.c
-				break;
-
-			// Detect redraw required
-			case XCB_EXPOSE:
-				ev->type = ET_EXPOSE;
-				found_event = true;
-				break;
-
-			// Detect key press
-			case XCB_KEY_PRESS: {
-				// Get keycode
-				uint8_t keycode =((xcb_key_press_event_t*)event)->detail;
-
-				// Updates state; this struct tracks things like SHIFT, CTRL
-				xkb_state_update_key(keyboard_state, keycode, XKB_KEY_DOWN);
-
-				// Keycode + state = unicode
-				char name_buffer[2]; // 1 character + \0
-				xkb_state_key_get_utf8(keyboard_state, keycode, name_buffer,
-					2);
-				//printf("Keycode %d, Unicode %s\n", keycode, name_buffer);
-
-				// Pass to main.c
-				ev->type = ET_KEYPRESS;
-				ev->kp_key = name_buffer[0];
-				found_event = true;
-				break;
+	//printf("XCB Event %d\n", event->response_type);
+	switch (event->response_type & ~0x80) {
+		// Detect exiting
+		case XCB_CLIENT_MESSAGE:
+			if (((xcb_client_message_event_t*)event)->data.data32[0]
+				== del_win_rep->atom) {
+				should_exit = true;
 			}
+			found_event = false; // Event not processed by main.c
+			break;
 
-			case XCB_KEY_RELEASE: {
-				// Updates state; this struct tracks things like SHIFT, CTRL
-				uint8_t keycode =((xcb_key_press_event_t*)event)->detail;
-				xkb_state_update_key(keyboard_state, keycode, XKB_KEY_UP);
-				break;
-			}
-			
-			// Ignore all other events
-			default:
-				found_event = false;
-				break;
+		// Detect redraw required
+		case XCB_EXPOSE:
+			ev->type = ET_EXPOSE;
+			found_event = true;
+			break;
+
+		// Detect key press
+		case XCB_KEY_PRESS: {
+			// Get keycode
+			uint8_t keycode =((xcb_key_press_event_t*)event)->detail;
+			if (!keyboard_state) load_keymap();
+
+			// Updates state; this struct tracks things like SHIFT, CTRL
+			xkb_state_update_key(keyboard_state, keycode, XKB_KEY_DOWN);
+
+			// Keycode + state = unicode
+			char name_buffer[2]; // 1 character + \0
+			xkb_state_key_get_utf8(keyboard_state, keycode, name_buffer,
+				2);
+			//printf("Keycode %d, Unicode %s\n", keycode, name_buffer);
+
+			// Pass to main.c
+			ev->type = ET_KEYPRESS;
+			ev->kp_key = name_buffer[0];
+			found_event = true;
+			break;
 		}
+
+		case XCB_KEY_RELEASE: {
+			// Updates state; this struct tracks things like SHIFT, CTRL
+			uint8_t keycode =((xcb_key_press_event_t*)event)->detail;
+			if (!keyboard_state) load_keymap();
+			xkb_state_update_key(keyboard_state, keycode, XKB_KEY_UP);
+			break;
+		}
+		
+		// Ignore all other events
+		default:
+			found_event = false;
+			break;
+	}
+	return found_event;
+}
+
+// Blocks on the X connection and queues events the moment they arrive,
+// rather than main.c finding them at its next frame
+void *event_thread_main(void *arg) {
+	xcb_generic_event_t *event;
+	while ((event = xcb_wait_for_event(connection))) {
+		struct event ev = { .type = ET_IGNORE, .time_ns = clock_ns() };
+		bool found_event = translate_event(event, &ev);
 		free(event);
+
+		pthread_mutex_lock(&event_lock);
+		// Queue full: wait for main.c to take some, rather than lose keys
+		while (found_event && event_count == EVENT_QUEUE_LENGTH &&
+				!should_exit)
+			pthread_cond_wait(&space_cond, &event_lock);
+		if (found_event && event_count < EVENT_QUEUE_LENGTH) {
+			event_queue[(event_head + event_count) % EVENT_QUEUE_LENGTH] = ev;
+			event_count++;
+		}
+		pthread_cond_signal(&event_cond); // Also wakes us up for should_exit
+		pthread_mutex_unlock(&event_lock);
+	}
+
+	// Connection died; nothing more will ever arrive
+	pthread_mutex_lock(&event_lock);
+	should_exit = true;
+	pthread_cond_signal(&event_cond);
+	pthread_mutex_unlock(&event_lock);
+	return NULL;
+}
+
+bool os_poll_event(struct event *ev) {
+	bool found_event = false;
+	pthread_mutex_lock(&event_lock);
+	if (event_count > 0) {
+		*ev = event_queue[event_head];
+		event_head = (event_head + 1) % EVENT_QUEUE_LENGTH;
+		event_count--;
+		found_event = true;
+		pthread_cond_signal(&space_cond);
 	}
+	pthread_mutex_unlock(&event_lock);
 	return found_event;
 }
 
+bool os_event_pending(void) {
+	return atomic_load_explicit(&event_count, memory_order_relaxed) > 0;
+}
+
+void os_wait_event(unsigned long long ns) {
+	bool timed = ns != 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ns += ts.tv_nsec;
+	ts.tv_sec += ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	xcb_flush(connection);
+	pthread_mutex_lock(&event_lock);
+	while (event_count == 0 && !should_exit && !wake_requested) {
+		if (!timed) pthread_cond_wait(&event_cond, &event_lock);
+		else if (pthread_cond_timedwait(&event_cond, &event_lock, &ts))
+			break; // Timed out
+	}
+	wake_requested = false;
+	pthread_mutex_unlock(&event_lock);
+}
+
+void os_wake(void) {
+	pthread_mutex_lock(&event_lock);
+	wake_requested = true;
+	pthread_cond_signal(&event_cond);
+	pthread_mutex_unlock(&event_lock);
+}
+
 void os_draw_rect(int x, int y, int w, int h, const float* rgb, int color) {
 	xcb_rectangle_t pix_rect[] = {{x, y, w, h}};
 	xcb_poly_fill_rectangle(connection, window, xcb_colors[color], 1, pix_rect);
@@ -170,6 +170,7 @@ bool os_poll_event(struct event *ev) {
 	NSEvent *e;
 	if ((e = [NSApp nextEventMatchingMask:NSEventMaskAny
 			untilDate:nil inMode:NSDefaultRunLoopMode dequeue:YES])) {
+		ev->time_ns = 0; // Unknown
 		switch (e.type) {
 			case NSEventTypeKeyDown:
 				ev->type = ET_KEYPRESS;
@@ -186,6 +187,26 @@ bool os_poll_event(struct event *ev) {
 	return false;
 }
 
+bool os_event_pending() {
+	return false; // Events are only picked up on I/O frames
+}
+
+void os_wait_event(unsigned long long ns) {
+	// Don't dequeue; os_poll_event will pick it up
+	NSDate *until = ns ? [NSDate dateWithTimeIntervalSinceNow:ns / 1e9] :
+		[NSDate distantFuture];
+	[NSApp nextEventMatchingMask:NSEventMaskAny untilDate:until
+		inMode:NSDefaultRunLoopMode dequeue:NO];
+}
+
+void os_wake() {
+	// Any event ends the wait; os_poll_event ignores this one
+	NSEvent *e = [NSEvent otherEventWithType:NSEventTypeApplicationDefined
+		location:NSZeroPoint modifierFlags:0 timestamp:0 windowNumber:0
+		context:nil subtype:0 data1:0 data2:0];
+	[NSApp postEvent:e atStart:NO];
+}
+
 // Coordinate system: 0,0 is top left. Quartz is bottom left.
 void os_draw_rect(int x, int y, int w, int h, const float* colors, int c) {
 	float r = colors[c * 3 + 0];
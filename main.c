@@ -17,22 +17,45 @@
 
 #include "os.h"
 
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // Everything, for code built for AVX2 or SSSE3 alone
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#ifndef WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 /* RESERVED MEMORY BLOCKS
 *  0x0100 to 0x01FF for stack (top to bottom)
 *  0x0200 to 0x05FF for screen
 *  0x0800 onwards for code
+*  0xFFF0 to 0xFFF3 for the timer, 0xFFFA to 0xFFFF for interrupt vectors
 */
 
 // Config
 #define TOTAL_MEM 65536
+#define PAGE_SIZE 0x0100
+#define PAGE_COUNT (TOTAL_MEM / PAGE_SIZE)
 #define LOAD_START 0x0600
 #define PC_START 0x0600
 #define STACK_TOP 0x01FF
@@ -40,23 +63,20 @@
 #define SCREEN_LENGTH 0x0400
 #define SCREEN_WIDTH 0x0020
 #define SCREEN_HEIGHT 0x0020
+#define TIMER_START 0xFFF0 // Timer and interrupt registers, 4 bytes
 #define PIXEL_SIZE 10 // How big is a fake pixel?
 #define FRAME_INTERVAL 16666666 // In ns
 #define DEFAULT_LIMIT_ENABLE 1
 #define DEFAULT_LIMIT_KHZ 30
-#define START_DELAY 500000000 // In ns
+#define START_DELAY 500000000 // Longest to wait for the window, in ns
 #define DEBUG_COREDUMP 1 // Coredumps on exit, also enables for step coredump
 #define DEBUG_COREDUMP_START 0x0000
 #define DEBUG_COREDUMP_END 0x00FF
-#define DEBUG_STEP 0 // Allows user to step per cycle
-#define DEBUG_BREAKPOINT 1 // Goes into stepping mode when breakpoint reached
-#define DEBUG_BREAKPOINT_MODE 2 // 0 = addr, 1 = ins_count, 2 = trapped
-#define DEBUG_BREAKPOINT_VALUE 106688
-#define DEBUG_LOG 0 // Logs all instructions processed
-#define DEBUG_LOG_CMP 1 // Log compares (useful for Klaus tests) 
-#define DEBUG_DIFFLOG 0 // Generates memory and reg changes, to compare & debug
-#define DEBUG_DIFFLOG_FILE "difflog_mine.txt"
 #define HALT_ON_INVALID 1
+#define RUN_BATCH 10000 // Most instructions run between I/O checks
+#define DEFAULT_REWIND_KB 4096 // Memory budget for the rewind buffer
+#define DEFAULT_METRICS_MS 1000 // How often to write a metrics line
+#define WATCH_POLL_MS 250 // How often -watch looks, without inotify
 
 // Config colors
 // Must change rendering " & 0xf" code if changing color count!
@@ -88,20 +108,245 @@ unsigned long long get_clock_ns(void) {
 	else return 0;
 }
 
+// Keyboard input on its way to $FF
+// A key stays in $FF until the program consumes it by reading $FF or writing
+// 0 to it (the 6502js convention); only then does the next queued key go in.
+#define KEY_QUEUE_LENGTH 64
+struct key_queue {
+	uint8_t keys[KEY_QUEUE_LENGTH];
+	unsigned long long times[KEY_QUEUE_LENGTH]; // When the OS got each key
+	int head; int count;
+	bool in_ff; // Is there an unconsumed key in $FF?
+	bool consumed; // Did the program just read $FF or write 0 to it?
+	unsigned long long queued; unsigned long long dropped;
+	unsigned long long latency_count; unsigned long long latency_total;
+	unsigned long long latency_max; // OS receiving the key -> key in $FF
+};
+
+// Random $FE; our own xorshift so a seed repeats on every platform
+uint8_t rng_next(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x >> 24;
+}
+
+// Scripted keypresses, each pushed when ins_count reaches its "at"
+// Script lines are "ins_count key_in_hex", with "# seed N" to seed $FE.
+struct input_event { unsigned long long at; uint8_t key; };
+struct input_script { struct input_event *events; int length; int next; };
+
+// Next key will be the first one due at or after ins_count
+void script_seek(struct input_script *script, unsigned long long ins_count) {
+	script->next = 0;
+	while (script->next < script->length &&
+			script->events[script->next].at < ins_count)
+		script->next++;
+}
+
+// Returns false if the script can't be read
+bool load_input_script(const char *path, struct input_script *script,
+		unsigned long *seed, bool *seeded) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) return false;
+	int capacity = 64;
+	script->events = malloc(capacity * sizeof(struct input_event));
+	script->length = 0;
+	script->next = 0;
+	char line[128];
+	while (fgets(line, sizeof(line), fp)) {
+		struct input_event e;
+		unsigned int key;
+		if (line[0] == '#') {
+			if (!*seeded && sscanf(line, "# seed %lu", seed) == 1)
+				*seeded = true;
+			continue;
+		}
+		if (sscanf(line, "%llu %x", &e.at, &key) != 2) continue;
+		e.key = key;
+		if (script->length == capacity) {
+			capacity *= 2;
+			script->events = realloc(script->events,
+				capacity * sizeof(struct input_event));
+		}
+		script->events[script->length++] = e;
+	}
+	fclose(fp);
+	return true;
+}
+
+// Bits in machine.dirty; rewinding and state hashes each clear their own
+#define DIRTY_REWIND 1
+#define DIRTY_HASH 2
+#define DIRTY_ALL (DIRTY_REWIND | DIRTY_HASH)
+
+// Timer and interrupts
+// The timer counts cycles and raises an IRQ (or NMI) when it runs out, and
+// vblank raises an IRQ every frame. The run loop only looks at any of this
+// once the cycle count reaches machine.event_at.
+#define EVENT_NEVER ULLONG_MAX
+#define TIMER_ON 0x01 // Control bits, at TIMER_START + 2
+#define TIMER_ONE_SHOT 0x02 // Stop after firing once, instead of repeating
+#define TIMER_NMI 0x04 // Fire an NMI instead of an IRQ
+#define VBLANK_ON 0x08 // IRQ at the start of every frame
+#define TIMER_FIRED 0x01 // Status bits, at TIMER_START + 3; reading clears
+#define VBLANK_FIRED 0x02
+struct interrupts {
+	uint16_t period; uint8_t control; uint8_t status; // Registers
+	unsigned long long timer_at; // Cycle the timer fires at, if TIMER_ON
+	bool nmi; // NMI fired and not taken yet
+	bool waiting; // Asleep in WAI until an interrupt
+};
+
+// Everything about one emulated machine
+struct machine {
+	uint16_t pc; uint8_t ac; uint8_t x; uint8_t y; uint8_t sr; uint8_t sp;
+	uint8_t *mem; // TOTAL_MEM bytes
+	uint8_t *dirty; // Per 256-byte page: DIRTY_ bits, written since cleared?
+	bool halt; // Is the sim halted? (Pauses the sim if true)
+	bool no_pc_inc; // Hack to let opcodes tell sim not to inc pc once
+	unsigned long long ins_count; // Instructions run, for average speed
+	unsigned long long cycles; // 1 instruction = 1 cycle, for now
+	unsigned long long frames; // I/O frames ended by the cycle limiter
+	unsigned long frame_cycles; // Cycles so far this I/O frame
+	uint32_t rng_state; // $FE
+	struct key_queue keys; // $FF
+	struct interrupts irq; // TIMER_START, and the vectors
+	unsigned long long event_at; // Look at irq when cycles get here
+};
+
+// Breakpoints and watchpoints set at runtime, one bit per address
+// Not part of the machine, so snapshots and rewinding leave them alone.
+struct breakpoints {
+	uint8_t pc[TOTAL_MEM / 8]; // Break before running the instruction here
+	uint8_t read[TOTAL_MEM / 8]; uint8_t write[TOTAL_MEM / 8];
+	int pc_count; int watch_count; // How many bits are set
+	bool hit; char hit_kind; uint16_t hit_addr; // Watchpoint just triggered
+};
+
+bool bp_test(const uint8_t *set, uint16_t addr) {
+	return set[addr >> 3] >> (addr & 7) & 1;
+}
+
+// Flips one bit, keeping count. Returns true if it is now set.
+bool bp_toggle(uint8_t *set, int *count, uint16_t addr) {
+	set[addr >> 3] ^= 1 << (addr & 7);
+	bool armed = bp_test(set, addr);
+	*count += armed ? 1 : -1;
+	return armed;
+}
+
+void bp_hit(struct breakpoints *b, char kind, uint16_t addr) {
+	b->hit = true;
+	b->hit_kind = kind;
+	b->hit_addr = addr;
+}
+
+// Addresses are hex, with or without a leading $
+uint16_t parse_addr(const char *text) {
+	if (*text == '$') text++;
+	return strtol(text, NULL, 16);
+}
+
+// Prints every address set
+void bp_list(FILE *fp, const char *name, const uint8_t *set) {
+	fprintf(fp, "%s:", name);
+	for (int i = 0; i < TOTAL_MEM; i++)
+		if (bp_test(set, i)) fprintf(fp, " %04x", i);
+	fputs("\n", fp);
+}
+
+// Coverage: how many times each address was run, read and written
+// Reads and writes are the program's own loads and stores, like watchpoints,
+// and an instruction that reads its operand twice counts twice.
+#define COVERAGE_MAGIC "6502COV1"
+struct coverage {
+	uint64_t exec[TOTAL_MEM]; uint64_t read[TOTAL_MEM];
+	uint64_t write[TOTAL_MEM];
+};
+
+// File: magic, then for each of exec, read, write: a bitmap of the addresses
+// touched, followed by a count for each of them (host byte order)
+bool coverage_save(const char *path, const struct coverage *cov) {
+	FILE *fp = fopen(path, "wb");
+	if (!fp) return false;
+	bool ok = fwrite(COVERAGE_MAGIC, 8, 1, fp) == 1;
+	const uint64_t *counts[] = { cov->exec, cov->read, cov->write };
+	for (int k = 0; k < 3; k++) {
+		uint8_t bitmap[TOTAL_MEM / 8] = {0};
+		for (int i = 0; i < TOTAL_MEM; i++)
+			if (counts[k][i]) bitmap[i >> 3] |= 1 << (i & 7);
+		ok = ok && fwrite(bitmap, sizeof(bitmap), 1, fp) == 1;
+		for (int i = 0; i < TOTAL_MEM; i++)
+			if (counts[k][i])
+				ok = ok && fwrite(&counts[k][i], 8, 1, fp) == 1;
+	}
+	if (fclose(fp) != 0) ok = false;
+	return ok;
+}
+
+// Adds a coverage file's counts to ours. Returns false if it can't be read.
+bool coverage_merge(const char *path, struct coverage *cov) {
+	FILE *fp = fopen(path, "rb");
+	if (!fp) return false;
+	char magic[8];
+	bool ok = fread(magic, 8, 1, fp) == 1 &&
+		memcmp(magic, COVERAGE_MAGIC, 8) == 0;
+	uint64_t *counts[] = { cov->exec, cov->read, cov->write };
+	for (int k = 0; k < 3 && ok; k++) {
+		uint8_t bitmap[TOTAL_MEM / 8];
+		ok = fread(bitmap, sizeof(bitmap), 1, fp) == 1;
+		for (int i = 0; i < TOTAL_MEM && ok; i++) {
+			uint64_t count;
+			if (!bp_test(bitmap, i)) continue;
+			ok = fread(&count, 8, 1, fp) == 1;
+			counts[k][i] += count;
+		}
+	}
+	fclose(fp);
+	return ok;
+}
+
+// One line per kind: addresses touched, where, and how often
+void coverage_summary(FILE *fp, const struct coverage *cov) {
+	const char *names[] = { "Executed", "Read", "Written" };
+	const uint64_t *counts[] = { cov->exec, cov->read, cov->write };
+	for (int k = 0; k < 3; k++) {
+		int addrs = 0; int low = -1; int high = -1;
+		unsigned long long total = 0;
+		for (int i = 0; i < TOTAL_MEM; i++) {
+			if (!counts[k][i]) continue;
+			if (low < 0) low = i;
+			high = i;
+			addrs++;
+			total += counts[k][i];
+		}
+		fprintf(fp, "Coverage: %s %d addresses", names[k], addrs);
+		if (addrs) fprintf(fp, " in %04x-%04x, %llu times", low, high, total);
+		fputs(".\n", fp);
+	}
+}
+
 // Widely used sim state
 struct sim_state { uint16_t *pc; uint8_t *ac; uint8_t *x; uint8_t *y;
-	uint8_t *sr; uint8_t *sp; uint8_t* mem; bool *halt; bool *no_pc_inc; };
+	uint8_t *sr; uint8_t *sp; uint8_t* mem; bool *halt; bool *no_pc_inc;
+	struct key_queue *keys; uint8_t *dirty; struct breakpoints *breaks;
+	struct memory_map *map; struct native_hooks *hooks; struct coverage *cov;
+	unsigned long long *cycles; unsigned long *frame_cycles;
+	struct interrupts *irq; unsigned long long *event_at; };
 
 // Write memory and registers to STDOUT for debug
-void coredump(struct sim_state s, uint16_t begin, uint16_t end) {
+void coredump(FILE *fp, struct sim_state s, uint16_t begin, uint16_t end) {
 	if (!DEBUG_COREDUMP) return;
 	for (int i = begin; i <= end; i += 0x10) {
-		printf("%04x: ", i);
+		fprintf(fp, "%04x: ", i);
 		for (int j = i; j < i + 0x10; j++)
-			printf("%02x ", s.mem[j]);
-		puts("");
+			fprintf(fp, "%02x ", s.mem[j]);
+		fputs("\n", fp);
 	}
-	printf("PC:%04x, AC:%02x, X:%02x, Y:%02x, SP:%02x, SR:%02x\n",
+	fprintf(fp, "PC:%04x, AC:%02x, X:%02x, Y:%02x, SP:%02x, SR:%02x\n",
 		*s.pc, *s.ac, *s.x, *s.y, *s.sp, *s.sr);
 }
 
@@ -112,6 +357,296 @@ void print_difflog(FILE *fp, unsigned long long ins_count, uint8_t *mem,
 		pc, name, old, new);
 }
 
+struct sim_state sim_state_of(struct machine *m) {
+	return (struct sim_state){ .pc = &m->pc, .ac = &m->ac, .x = &m->x,
+		.y = &m->y, .sr = &m->sr, .sp = &m->sp, .mem = m->mem,
+		.halt = &m->halt, .no_pc_inc = &m->no_pc_inc, .keys = &m->keys,
+		.dirty = m->dirty, .cycles = &m->cycles,
+		.frame_cycles = &m->frame_cycles, .irq = &m->irq,
+		.event_at = &m->event_at };
+}
+
+// State hashes
+// Memory hashes as the XOR of a hash per page, so pages can be hashed on
+// their own, mixed with the registers and the devices' state
+uint64_t hash_mix(uint64_t x) { // splitmix64's finalizer
+	x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+	return x ^ x >> 31;
+}
+uint64_t page_hash(const uint8_t *page, int p) {
+	uint64_t h = 0xcbf29ce484222325ULL ^ p; // FNV-1a
+	for (int i = 0; i < PAGE_SIZE; i++) h = (h ^ page[i]) * 0x100000001b3ULL;
+	return hash_mix(h);
+}
+uint64_t registers_hash(const struct machine *m) {
+	uint64_t h = hash_mix((uint64_t)m->pc | (uint64_t)m->ac << 16 |
+		(uint64_t)m->x << 24 | (uint64_t)m->y << 32 | (uint64_t)m->sr << 40 |
+		(uint64_t)m->sp << 48 | (uint64_t)m->halt << 56);
+	h = hash_mix(h ^ (m->rng_state | (uint64_t)m->keys.in_ff << 32 |
+		(uint64_t)m->keys.consumed << 33 | (uint64_t)m->keys.count << 40));
+	for (int i = 0; i < m->keys.count; i++) // Oldest first
+		h = hash_mix(h ^ m->keys.keys[(m->keys.head + i) % KEY_QUEUE_LENGTH]);
+	h = hash_mix(h ^ (m->irq.period | (uint64_t)m->irq.control << 16 |
+		(uint64_t)m->irq.status << 24 | (uint64_t)m->irq.nmi << 32 |
+		(uint64_t)m->irq.waiting << 33));
+	return hash_mix(h ^ m->irq.timer_at);
+}
+
+// Keeps every page's hash, so each state hash only rehashes the pages
+// written since the one before (and pages 0 and 1, which $FE, $FF and the
+// stack change without going through bus_write)
+struct state_hasher { uint64_t pages[PAGE_COUNT]; uint64_t memory; bool ready; };
+uint64_t state_hash(struct state_hasher *h, struct machine *m) {
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		if (h->ready && p > 1 && !(m->dirty[p] & DIRTY_HASH)) continue;
+		uint64_t page = page_hash(m->mem + p * PAGE_SIZE, p);
+		h->memory ^= h->pages[p] ^ page;
+		h->pages[p] = page;
+		m->dirty[p] &= ~DIRTY_HASH;
+	}
+	h->ready = true;
+	return h->memory ^ registers_hash(m);
+}
+
+// Hash logs
+// A state hash every frame, or every so many instructions, in the difflog
+// format. Two runs' logs can be compared with diff, or one run can check
+// its hashes against another's log as it goes.
+struct hashlog {
+	FILE *fp; FILE *check_fp; // Either may be NULL
+	unsigned long long every; // Instructions between lines; 0 = every frame
+	unsigned long long from; // No lines before this instruction
+	unsigned long long next; // Instruction the next line is due at (every)
+	unsigned long long matched; // Last instruction checked and found equal
+};
+
+// Logs, and checks, the hash now. Returns false at the first line that
+// differs from the log being checked.
+bool hashlog_step(struct hashlog *hl, struct state_hasher *h,
+		struct machine *m) {
+	char line[80], want[80];
+	snprintf(line, sizeof(line), "%llu: Ins %02x @ %04x, hash %016llx\n",
+		m->ins_count, m->mem[m->pc], m->pc,
+		(unsigned long long)state_hash(h, m));
+	if (hl->fp) fputs(line, hl->fp);
+	if (!hl->check_fp) return true;
+	if (!fgets(want, sizeof(want), hl->check_fp)) { // Nothing left to check
+		fclose(hl->check_fp);
+		hl->check_fp = NULL;
+		return true;
+	}
+	if (strcmp(line, want) == 0) {
+		hl->matched = m->ins_count;
+		return true;
+	}
+	printf("Hashes diverge after instruction %llu.\nExpected %sGot      %s",
+		hl->matched, want, line);
+	if (hl->every != 1)
+		printf("Rerun both with -hashlog-every 1 -hashlog-from %llu to find "
+			"the instruction.\n", hl->matched);
+	fclose(hl->check_fp);
+	hl->check_fp = NULL;
+	return false;
+}
+
+// Puts a key into $FF right now
+void key_deliver(struct key_queue *k, uint8_t *mem, uint8_t key,
+		unsigned long long time) {
+	mem[0xFF] = key;
+	k->in_ff = true;
+	if (time) { // Track how long it took to get here
+		unsigned long long latency = get_clock_ns() - time;
+		k->latency_total += latency;
+		if (latency > k->latency_max) k->latency_max = latency;
+		k->latency_count++;
+	}
+}
+
+// New key from the OS (time 0 if unknown); queued if $FF is still in use
+void key_push(struct key_queue *k, uint8_t *mem, uint8_t key,
+		unsigned long long time) {
+	if (!k->in_ff) key_deliver(k, mem, key, time);
+	else if (k->count < KEY_QUEUE_LENGTH) {
+		int i = (k->head + k->count++) % KEY_QUEUE_LENGTH;
+		k->keys[i] = key;
+		k->times[i] = time;
+	}
+	else {
+		k->dropped++;
+		return;
+	}
+	k->queued++;
+}
+
+// Program is done with $FF; move the next key in, if any
+void key_consume(struct key_queue *k, uint8_t *mem) {
+	k->consumed = false;
+	k->in_ff = false;
+	if (k->count == 0) return;
+	key_deliver(k, mem, k->keys[k->head], k->times[k->head]);
+	k->head = (k->head + 1) % KEY_QUEUE_LENGTH;
+	k->count--;
+}
+
+// Pushes the scripted keys due by this instruction
+void script_deliver(struct input_script *script, struct machine *m) {
+	while (script->next < script->length &&
+			script->events[script->next].at <= m->ins_count)
+		key_push(&m->keys, m->mem, script->events[script->next++].key, 0);
+}
+
+// Memory map
+// Every address is plain RAM unless a device has claimed it. One bit per
+// address says which, so ordinary loads and stores cost a single test, even
+// on zero page beside $FE and $FF. Devices keep what they want the program
+// to see in mem.
+struct device {
+	uint8_t (*read)(struct device *dev, struct sim_state s, uint16_t addr);
+	void (*write)(struct device *dev, struct sim_state s, uint16_t addr,
+		uint8_t value);
+	void *state;
+};
+struct io_page {
+	struct device *read[PAGE_SIZE]; struct device *write[PAGE_SIZE];
+};
+struct memory_map {
+	uint8_t reads[TOTAL_MEM / 8]; uint8_t writes[TOTAL_MEM / 8]; // Claimed?
+	struct io_page *pages[PAGE_COUNT]; // Who claimed them; NULL = all RAM
+};
+
+// Gives addresses first to last to a device, for reads and/or writes
+void map_device(struct memory_map *map, struct device *dev, uint16_t first,
+		uint16_t last, bool reads, bool writes) {
+	for (int addr = first; addr <= last; addr++) {
+		struct io_page **page = &map->pages[addr / PAGE_SIZE];
+		if (!*page) *page = calloc(1, sizeof(struct io_page));
+		if (reads) {
+			(*page)->read[addr % PAGE_SIZE] = dev;
+			map->reads[addr >> 3] |= 1 << (addr & 7);
+		}
+		if (writes) {
+			(*page)->write[addr % PAGE_SIZE] = dev;
+			map->writes[addr >> 3] |= 1 << (addr & 7);
+		}
+	}
+}
+
+void map_free(struct memory_map *map) {
+	for (int i = 0; i < PAGE_COUNT; i++) free(map->pages[i]);
+}
+
+// Memory access for address modes
+uint8_t bus_read(struct sim_state s, uint16_t addr) {
+	if (!bp_test(s.map->reads, addr)) return s.mem[addr];
+	struct device *dev = s.map->pages[addr / PAGE_SIZE]->read[addr % PAGE_SIZE];
+	return dev->read(dev, s, addr);
+}
+void bus_write(struct sim_state s, uint16_t addr, uint8_t value) {
+	s.dirty[addr >> 8] = DIRTY_ALL;
+	if (!bp_test(s.map->writes, addr)) {
+		s.mem[addr] = value;
+		return;
+	}
+	struct device *dev = s.map->pages[addr / PAGE_SIZE]->write[addr % PAGE_SIZE];
+	dev->write(dev, s, addr, value);
+}
+
+// $FF: the program consumes a key by reading it or writing 0 over it
+uint8_t keys_read(struct device *dev, struct sim_state s, uint16_t addr) {
+	((struct key_queue*)dev->state)->consumed = true;
+	return s.mem[addr];
+}
+void keys_write(struct device *dev, struct sim_state s, uint16_t addr,
+		uint8_t value) {
+	if (value == 0) ((struct key_queue*)dev->state)->consumed = true;
+	s.mem[addr] = value;
+}
+
+// $FE: a new random number every read
+uint8_t random_read(struct device *dev, struct sim_state s, uint16_t addr) {
+	return s.mem[addr] = rng_next(dev->state);
+}
+// Or not, for difflogs (decided by coin flip)
+uint8_t fixed_random_read(struct device *dev, struct sim_state s,
+		uint16_t addr) {
+	return s.mem[addr] = 7;
+}
+
+// Screen: remembers which rows were drawn on, so rendering only has to look
+// at those
+struct screen { bool dirty_rows[SCREEN_HEIGHT]; };
+void screen_write(struct device *dev, struct sim_state s, uint16_t addr,
+		uint8_t value) {
+	((struct screen*)dev->state)->dirty_rows[(addr - SCREEN_START) /
+		SCREEN_WIDTH] = true;
+	s.mem[addr] = value;
+}
+
+// Timer: period low and high (in cycles, 0 = 65536), control, status
+unsigned long timer_period(const struct interrupts *in) {
+	return in->period ? in->period : 65536;
+}
+// Whether a fired timer or vblank is raising IRQ, until the status is read
+bool irq_raised(const struct interrupts *in) {
+	return ((in->status & TIMER_FIRED) && !(in->control & TIMER_NMI)) ||
+		(in->status & VBLANK_FIRED);
+}
+uint8_t timer_read(struct device *dev, struct sim_state s, uint16_t addr) {
+	struct interrupts *in = s.irq;
+	uint8_t value;
+	switch (addr - TIMER_START) {
+		case 0: value = in->period & 0xFF; break;
+		case 1: value = in->period >> 8; break;
+		case 2: value = in->control; break;
+		default: // Status; reading it is how the program says it's handled
+			value = in->status;
+			in->status = 0;
+			*s.event_at = 0; // IRQ line may have dropped
+			break;
+	}
+	// The registers are mirrored in memory, so a changed one has to mark
+	// its page like a write would, for hashes and rewind to see it
+	if (s.mem[addr] != value) {
+		s.mem[addr] = value;
+		s.dirty[addr / PAGE_SIZE] = DIRTY_ALL;
+	}
+	return value;
+}
+void timer_write(struct device *dev, struct sim_state s, uint16_t addr,
+		uint8_t value) {
+	struct interrupts *in = s.irq;
+	s.mem[addr] = value;
+	switch (addr - TIMER_START) {
+		case 0: in->period = (in->period & 0xFF00) | value; break;
+		case 1: in->period = (in->period & 0x00FF) | value << 8; break;
+		case 2: // Turning the timer on (again) starts a whole period
+			in->control = value;
+			if (value & TIMER_ON) in->timer_at = *s.cycles + timer_period(in);
+			break;
+		default: break;
+	}
+	*s.event_at = 0; // Deadlines may have moved
+}
+
+// Same again, but first checking the watchpoints (and counting coverage)
+uint8_t watch_read(struct sim_state s, uint16_t addr) {
+	if (s.cov) s.cov->read[addr]++;
+	if (bp_test(s.breaks->read, addr)) bp_hit(s.breaks, 'r', addr);
+	return bus_read(s, addr);
+}
+void watch_write(struct sim_state s, uint16_t addr, uint8_t value) {
+	if (s.cov) s.cov->write[addr]++;
+	if (bp_test(s.breaks->write, addr)) bp_hit(s.breaks, 'w', addr);
+	bus_write(s, addr, value);
+}
+
+// Address modes are built twice: plain, and watched for when watchpoints are
+// armed. "watched" is a constant in each build, so the plain one never even
+// looks at the watchpoints.
+#define mem_read(s, a) (watched ? watch_read(s, a) : bus_read(s, a))
+#define mem_write(s, a, v) (watched ? watch_write(s, a, v) : bus_write(s, a, v))
+
 // Datatype converters 
 uint16_t i8to16(uint8_t h, uint8_t l) { return (uint16_t)h << 8 | l; }
 
@@ -133,8 +668,6 @@ void push(uint8_t *mem, uint8_t *sp, uint8_t new_value) {
 }
 uint8_t pop(uint8_t *mem, uint8_t *sp) { return mem[++(*sp) + 0x0100]; }
 void cmp(struct sim_state s, uint8_t reg, uint8_t get) {
-	if (DEBUG_LOG && DEBUG_LOG_CMP)
-		printf("Comparing reg=%x, mem=%x\n", reg, get);
 	uint8_t t = reg - get;
 	if (reg < get) {
 		*s.sr = bit_set(*s.sr, 7, bit_get(t, 7));
@@ -213,25 +746,129 @@ void adc(struct sim_state s, uint8_t input, bool sub) {
 	*s.ac = sr_nz(s.sr, t);
 }
 
+// Native hooks
+// A JSR to a hooked address runs a C version of the routine instead, then
+// carries on after the JSR as if the routine had returned. Each routine says
+// how many instructions the 6502 version would have taken (counting its RTS),
+// so frames and cycle counts come out the same every run.
+#define MAX_NATIVE_HOOKS 64
+struct native_routine {
+	const char *name;
+	unsigned long (*run)(struct sim_state s, uint8_t zp); // Returns cost
+};
+struct native_hook { const struct native_routine *routine; uint8_t zp; };
+struct native_hooks {
+	uint8_t index[TOTAL_MEM]; // Hook number + 1 for each address, 0 = none
+	struct native_hook hooks[MAX_NATIVE_HOOKS]; int count;
+};
+
+uint16_t zp_word(struct sim_state s, uint8_t zp) {
+	return i8to16(s.mem[zp + 1], s.mem[zp]);
+}
+
+// mul8: A * X, low byte of the product in A, high byte in X
+unsigned long native_mul8(struct sim_state s, uint8_t zp) {
+	uint16_t product = *s.ac * *s.x;
+	*s.x = product >> 8;
+	*s.ac = sr_nz(s.sr, product & 0xFF);
+	return 40; // Shift-and-add, 8 rounds
+}
+
+// div8: A / X, quotient in A, remainder in X, carry set if X was 0
+unsigned long native_div8(struct sim_state s, uint8_t zp) {
+	if (*s.x == 0) {
+		*s.sr = bit_set(*s.sr, 0, 1);
+		return 4;
+	}
+	uint8_t quotient = *s.ac / *s.x;
+	*s.x = *s.ac % *s.x;
+	*s.ac = sr_nz(s.sr, quotient);
+	*s.sr = bit_set(*s.sr, 0, 0);
+	return 50; // Shift-and-subtract, 8 rounds
+}
+
+// memcpy: copies (zp+4) bytes from (zp) to (zp+2), first byte first
+unsigned long native_memcpy(struct sim_state s, uint8_t zp) {
+	uint16_t src = zp_word(s, zp), dst = zp_word(s, zp + 2);
+	uint16_t length = zp_word(s, zp + 4);
+	for (uint16_t i = 0; i < length; i++)
+		bus_write(s, dst + i, bus_read(s, src + i));
+	return 10 + 4 * length + 5 * (length / PAGE_SIZE); // LDA, STA, INY, BNE
+}
+
+// fill: stores A into (zp+2) bytes from (zp)
+unsigned long native_fill(struct sim_state s, uint8_t zp) {
+	uint16_t dst = zp_word(s, zp), length = zp_word(s, zp + 2);
+	for (uint16_t i = 0; i < length; i++) bus_write(s, dst + i, *s.ac);
+	return 10 + 3 * length + 5 * (length / PAGE_SIZE); // STA, INY, BNE
+}
+
+const struct native_routine native_routines[] = {
+	{ "mul8", native_mul8 }, { "div8", native_div8 },
+	{ "memcpy", native_memcpy }, { "fill", native_fill }
+};
+#define NATIVE_ROUTINE_COUNT \
+	(int)(sizeof(native_routines) / sizeof(native_routines[0]))
+
+// Hooks "ADDR:name" or "ADDR:name:ZP" (ZP defaults to F0).
+// Returns false if the spec is malformed, the name is unknown, the address
+// is already hooked or there are too many hooks.
+bool native_hook_add(struct native_hooks *h, const char *spec) {
+	char name[32] = {0};
+	char *end;
+	if (h->count == MAX_NATIVE_HOOKS) return false;
+	if (*spec == '$') spec++;
+	long addr = strtol(spec, &end, 16);
+	if (end == spec || *end != ':' || addr < 0 || addr >= TOTAL_MEM) {
+		return false;
+	}
+	if (h->index[addr]) return false;
+
+	const char *rest = end + 1;
+	size_t len = strcspn(rest, ":");
+	if (len == 0 || len >= sizeof(name)) return false;
+	memcpy(name, rest, len);
+
+	long zp = 0xF0;
+	if (rest[len] == ':') {
+		const char *text = rest + len + 1;
+		if (*text == '$') text++;
+		zp = strtol(text, &end, 16);
+		if (end == text || *end || zp < 0 || zp > 0xFF) return false;
+	}
+
+	for (int i = 0; i < NATIVE_ROUTINE_COUNT; i++) {
+		if (strcmp(native_routines[i].name, name) != 0) continue;
+		h->hooks[h->count] = (struct native_hook){ &native_routines[i], zp };
+		h->index[addr] = ++h->count;
+		return true;
+	}
+	return false;
+}
+
 // Instructions
 #define INS_DEF(N) void ins_##N(uint16_t (*get)(struct sim_state), \
 	void (*set)(uint8_t, struct sim_state), struct sim_state s)
 INS_DEF(JMP) { *s.pc = (*get)(s); *s.no_pc_inc = true; }
 INS_DEF(ADC) { adc(s, (*get)(s), false); }
 INS_DEF(AND) { *s.ac = sr_nz(s.sr, *s.ac & (*get)(s)); }
+// Instructions that use their operand more than once read it once, since
+// reading a device ($FE, the timer status) can change it
 INS_DEF(ASL) {
-	*s.sr = bit_set(*s.sr, 0, bit_get((*get)(s), 7));
-	(*set)(sr_nz(s.sr, (*get)(s) << 1), s);
+	uint8_t m = (*get)(s);
+	*s.sr = bit_set(*s.sr, 0, bit_get(m, 7));
+	(*set)(sr_nz(s.sr, m << 1), s);
 }
 INS_DEF(BCC) { if (!bit_get(*s.sr, 0)) { *s.pc = (*get)(s); } }
 INS_DEF(BCS) { if (bit_get(*s.sr, 0)) { *s.pc = (*get)(s); } }
 INS_DEF(BEQ) { if (bit_get(*s.sr, 1)) { *s.pc = (*get)(s); } }
 INS_DEF(BIT) {
+	uint8_t m = (*get)(s);
 	// A AND M
-	sr_nz(s.sr, *s.ac & (*get)(s));
+	sr_nz(s.sr, *s.ac & m);
 	// M7 -> N, M6 -> V
-	*s.sr = bit_set(*s.sr, 7, bit_get((*get)(s), 7));
-	*s.sr = bit_set(*s.sr, 6, bit_get((*get)(s), 6));
+	*s.sr = bit_set(*s.sr, 7, bit_get(m, 7));
+	*s.sr = bit_set(*s.sr, 6, bit_get(m, 6));
 }
 INS_DEF(BMI) { if (bit_get(*s.sr, 7)) { *s.pc = (*get)(s); } }
 INS_DEF(BNE) { if (!bit_get(*s.sr, 1)) { *s.pc = (*get)(s); } }
@@ -246,6 +883,15 @@ INS_DEF(CLV) { *s.sr = bit_set(*s.sr, 6, 0); }
 INS_DEF(CMP) { cmp(s, *s.ac, (*get)(s)); }
 INS_DEF(CPX) { cmp(s, *s.x, (*get)(s)); }
 INS_DEF(CPY) { cmp(s, *s.y, (*get)(s)); }
+// Compares for -log runs, which say what they compared (useful for Klaus
+// tests)
+void cmp_logged(struct sim_state s, uint8_t reg, uint8_t get) {
+	printf("Comparing reg=%x, mem=%x\n", reg, get);
+	cmp(s, reg, get);
+}
+INS_DEF(CMP_logged) { cmp_logged(s, *s.ac, (*get)(s)); }
+INS_DEF(CPX_logged) { cmp_logged(s, *s.x, (*get)(s)); }
+INS_DEF(CPY_logged) { cmp_logged(s, *s.y, (*get)(s)); }
 INS_DEF(DEC) { (*set)(sr_nz(s.sr, (*get)(s) - 1), s); }
 INS_DEF(DEX) { *s.x = sr_nz(s.sr, *s.x - 1); }
 INS_DEF(DEY) { *s.y = sr_nz(s.sr, *s.y - 1); }
@@ -260,12 +906,25 @@ INS_DEF(JSR) {
 	*s.pc = i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1]);
 	*s.no_pc_inc = true;
 }
+// Only in the table while native hooks are registered
+INS_DEF(JSR_native) {
+	uint8_t hook = s.hooks->index[i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])];
+	if (!hook) {
+		ins_JSR(get, set, s);
+		return;
+	}
+	struct native_hook *h = &s.hooks->hooks[hook - 1];
+	unsigned long cost = h->routine->run(s, h->zp);
+	*s.cycles += cost; // The JSR itself was counted already
+	*s.frame_cycles += cost;
+}
 INS_DEF(LDA) { *s.ac = sr_nz(s.sr, (*get)(s)); }
 INS_DEF(LDX) { *s.x = sr_nz(s.sr, (*get)(s)); }
 INS_DEF(LDY) { *s.y = sr_nz(s.sr, (*get)(s)); }
 INS_DEF(LSR) {
-	*s.sr = bit_set(*s.sr, 0, bit_get((*get)(s), 0));
-	(*set)(sr_nz(s.sr, (*get)(s) >> 1), s);
+	uint8_t m = (*get)(s);
+	*s.sr = bit_set(*s.sr, 0, bit_get(m, 0));
+	(*set)(sr_nz(s.sr, m >> 1), s);
 }
 INS_DEF(NOP) { /* :D */ }
 INS_DEF(ORA) { *s.ac = sr_nz(s.sr, (*get)(s) | *s.ac); }
@@ -287,13 +946,15 @@ INS_DEF(PLP) {
 }
 INS_DEF(ROL) {
 	int old_c = bit_get(*s.sr, 0);
-	*s.sr = bit_set(*s.sr, 0, bit_get((*get)(s), 7));
-	(*set)(sr_nz(s.sr, (*get)(s) << 1 | old_c), s);
+	uint8_t m = (*get)(s);
+	*s.sr = bit_set(*s.sr, 0, bit_get(m, 7));
+	(*set)(sr_nz(s.sr, m << 1 | old_c), s);
 }
 INS_DEF(ROR) {
 	int old_c = bit_get(*s.sr, 0);
-	*s.sr = bit_set(*s.sr, 0, bit_get((*get)(s), 0));
-	(*set)(sr_nz(s.sr, (*get)(s) >> 1 | old_c << 7), s);
+	uint8_t m = (*get)(s);
+	*s.sr = bit_set(*s.sr, 0, bit_get(m, 0));
+	(*set)(sr_nz(s.sr, m >> 1 | old_c << 7), s);
 }
 INS_DEF(RTI) {
 	// Essentially a PLP and then a RTS, but w/o + 1
@@ -324,61 +985,86 @@ INS_DEF(TSX) { *s.x = sr_nz(s.sr, *s.sp); }
 INS_DEF(TXA) { *s.ac = sr_nz(s.sr, *s.x); }
 INS_DEF(TXS) { *s.sp = *s.x; } // TSX sets NZ - TXS does not
 INS_DEF(TYA) { *s.ac = sr_nz(s.sr, *s.y); }
+// From the 65C02: sleep until an interrupt, rather than spinning on one
+// With the timer and vblank both off, nothing will ever come, so it halts
+INS_DEF(WAI) {
+	if (!(s.irq->control & (TIMER_ON | VBLANK_ON)) && !irq_raised(s.irq) &&
+			!s.irq->nmi) {
+		*s.halt = true;
+		return;
+	}
+	s.irq->waiting = true;
+	*s.event_at = 0; // So the run loop stops here
+}
 #undef INS_DEF
 
 // Address modes
 struct addr { uint16_t (*get)(struct sim_state); 
 	void (*set)(uint8_t, struct sim_state); int length; };
+#define ADDR_FNS(N, WATCHED, GET, SET) \
+	uint16_t addr_get_##N(struct sim_state s) { \
+		const bool watched = WATCHED; (void)watched; GET } \
+	void addr_set_##N(uint8_t a, struct sim_state s) { \
+		const bool watched = WATCHED; (void)watched; SET }
 #define ADDR_DEF(N, LEN, GET, SET) \
-	uint16_t addr_get_##N(struct sim_state s) { GET } \
-	void addr_set_##N(uint8_t a, struct sim_state s) { SET } \
+	ADDR_FNS(N, false, GET, SET) \
+	ADDR_FNS(N##_watched, true, GET, SET) \
 	const struct addr addr_##N = { .get = addr_get_##N, .set = addr_set_##N, \
-	.length = LEN };
+	.length = LEN }; \
+	const struct addr addr_##N##_watched = { .get = addr_get_##N##_watched, \
+	.set = addr_set_##N##_watched, .length = LEN };
 ADDR_DEF(ac, 1, return *s.ac;, *s.ac = a;);
-ADDR_DEF(abs, 3, return s.mem[i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])];,
-	s.mem[i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])] = a;);
+ADDR_DEF(abs, 3,
+	return mem_read(s, i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1]));,
+	mem_write(s, i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1]), a););
 ADDR_DEF(abs_dir, 3, return i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1]);, );
 ADDR_DEF(abs_x, 3,
-	return s.mem[i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])
-		+ *s.x/* + bit_get(*s.sr, 0)*/];,
-	s.mem[i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])
-		+ *s.x/* + bit_get(*s.sr, 0)*/] = a;);
+	return mem_read(s, i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])
+		+ *s.x/* + bit_get(*s.sr, 0)*/);,
+	mem_write(s, i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])
+		+ *s.x/* + bit_get(*s.sr, 0)*/, a););
 ADDR_DEF(abs_y, 3,
-	return s.mem[i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])
-		+ *s.y/* + bit_get(*s.sr, 0)*/];,
-	s.mem[i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])
-		+ *s.y/* + bit_get(*s.sr, 0)*/] = a;);
+	return mem_read(s, i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])
+		+ *s.y/* + bit_get(*s.sr, 0)*/);,
+	mem_write(s, i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1])
+		+ *s.y/* + bit_get(*s.sr, 0)*/, a););
 ADDR_DEF(imm, 2, return s.mem[*s.pc + 1];, );
+// Pointers are fetched straight from memory, like the operand bytes, so
+// they don't set off devices or watchpoints; only the access through them
+// does
 ADDR_DEF(ind_dir, 3,
 	uint16_t hhll = i8to16(s.mem[*s.pc + 2], s.mem[*s.pc + 1]);
-	return i8to16(s.mem[hhll + 1], s.mem[hhll]);, );
+	return i8to16(s.mem[(uint16_t)(hhll + 1)], s.mem[hhll]);, );
 ADDR_DEF(x_ind, 2,
 	uint8_t zp_x = s.mem[*s.pc + 1] + *s.x;
-	return s.mem[i8to16(s.mem[zp_x + 1], s.mem[zp_x])];,
+	return mem_read(s, i8to16(s.mem[zp_x + 1], s.mem[zp_x]));,
 	uint8_t zp_x = s.mem[*s.pc + 1] + *s.x;
-	s.mem[i8to16(s.mem[zp_x + 1], s.mem[zp_x])] = a;);
+	mem_write(s, i8to16(s.mem[zp_x + 1], s.mem[zp_x]), a););
 ADDR_DEF(ind_y, 2,
 	uint8_t zp = s.mem[*s.pc + 1];
-	return s.mem[i8to16(s.mem[zp + 1], s.mem[zp]) +
-	*s.y/* + bit_get(*s.sr, 0)*/];,
+	return mem_read(s, i8to16(s.mem[zp + 1], s.mem[zp]) +
+	*s.y/* + bit_get(*s.sr, 0)*/);,
 	uint8_t zp = s.mem[*s.pc + 1];
-	s.mem[i8to16(s.mem[zp + 1], s.mem[zp]) +
-	*s.y/* + bit_get(*s.sr, 0)*/] = a;);
+	mem_write(s, i8to16(s.mem[zp + 1], s.mem[zp]) +
+	*s.y/* + bit_get(*s.sr, 0)*/, a););
 ADDR_DEF(impl, 1, return 0;, );
 ADDR_DEF(rel, 2, return *s.pc + (int8_t)s.mem[*s.pc + 1];, );
 ADDR_DEF(zpg, 2,
-	return s.mem[s.mem[*s.pc + 1]];, s.mem[s.mem[*s.pc + 1]] = a;);
+	return mem_read(s, s.mem[*s.pc + 1]);, mem_write(s, s.mem[*s.pc + 1], a););
 ADDR_DEF(zpg_x, 2,
 	uint8_t zp = s.mem[*s.pc + 1] + *s.x; // Force wraparound
-	return s.mem[zp];,
+	return mem_read(s, zp);,
 	uint8_t zp = s.mem[*s.pc + 1] + *s.x; // Force wraparound
-	s.mem[zp] = a;);
+	mem_write(s, zp, a););
 ADDR_DEF(zpg_y, 2,
 	uint8_t zp = s.mem[*s.pc + 1] + *s.y; // Force wraparound
-	return s.mem[zp];,
+	return mem_read(s, zp);,
 	uint8_t zp = s.mem[*s.pc + 1] + *s.y; // Force wraparound
-	s.mem[zp] = a;);
+	mem_write(s, zp, a););
 #undef ADDR_DEF
+#undef ADDR_FNS
+#undef mem_read
+#undef mem_write
 
 // Opcodes
 // TODO: Add cycles
@@ -528,7 +1214,9 @@ void construct_opcodes_table(struct opcode *o) {
 	o[0xEA] = (struct opcode){ ins_NOP, &addr_impl };
 	// 0xfa undef
 	// -B
-	// 0x0b to 0xfb undef
+	// 0x0b to 0xbb undef
+	// 0xcb: WAI, only with -timer
+	// 0xdb to 0xfb undef
 	// -C
 	// 0x0c to 0x1c undef
 	o[0x2C] = (struct opcode){ ins_BIT, &addr_abs };
@@ -583,352 +1271,2337 @@ void construct_opcodes_table(struct opcode *o) {
 	// 0x0f to 0xff undef
 }
 
-int our_main(int argc, char** argv) {
-	// =====
-	// INIT
-	// =====
-	
-	// Seed random
-	srand((unsigned int)time(NULL));
+// Same opcodes, but with the watched address modes, for when watchpoints are
+// armed
+// The same instructions, but compares print what they compare
+void construct_logged_opcodes_table(struct opcode *l, const struct opcode *o) {
+	for (int op = 0; op < 0x100; op++) {
+		l[op] = o[op];
+		if (o[op].instruction == ins_CMP) l[op].instruction = ins_CMP_logged;
+		if (o[op].instruction == ins_CPX) l[op].instruction = ins_CPX_logged;
+		if (o[op].instruction == ins_CPY) l[op].instruction = ins_CPY_logged;
+	}
+}
 
-	// Create window
-	os_create_window("6502", 
-		SCREEN_WIDTH * PIXEL_SIZE, SCREEN_HEIGHT * PIXEL_SIZE);
-	os_create_colormap(colors, COLOR_COUNT);
+void construct_watched_opcodes_table(struct opcode *w, const struct opcode *o) {
+	const struct addr *modes[][2] = {
+		{ &addr_ac, &addr_ac_watched }, { &addr_abs, &addr_abs_watched },
+		{ &addr_abs_dir, &addr_abs_dir_watched },
+		{ &addr_abs_x, &addr_abs_x_watched },
+		{ &addr_abs_y, &addr_abs_y_watched }, { &addr_imm, &addr_imm_watched },
+		{ &addr_ind_dir, &addr_ind_dir_watched },
+		{ &addr_x_ind, &addr_x_ind_watched },
+		{ &addr_ind_y, &addr_ind_y_watched },
+		{ &addr_impl, &addr_impl_watched }, { &addr_rel, &addr_rel_watched },
+		{ &addr_zpg, &addr_zpg_watched }, { &addr_zpg_x, &addr_zpg_x_watched },
+		{ &addr_zpg_y, &addr_zpg_y_watched }
+	};
+	for (int op = 0; op < 0x100; op++) {
+		w[op] = o[op];
+		for (int i = 0; i < (int)(sizeof(modes) / sizeof(modes[0])); i++)
+			if (o[op].addr_mode == modes[i][0]) w[op].addr_mode = modes[i][1];
+	}
+}
 
-	// Handle command line, if no arg, ask with OS file dialog
-	char fileNameBuf[256];
-	if (argc < 2) {
-		// If no arg and true: fileNameBuf is set, continue
-		// If no arg and false, halt with instructions
-		if (!os_choose_bin(fileNameBuf, sizeof(fileNameBuf))) {
-			puts("Usage: 6502 file.bin [options]");
-			puts("Options:");
-			printf("-unlimited: Run with no speed limiter (default: %s)\n",
-				DEFAULT_LIMIT_ENABLE ? "limited" : "unlimited");
-			printf("-s(speed_in_khz): Set speed limit (default: %d)\n",
-				DEFAULT_LIMIT_KHZ); 
-			return 0;
+// Program images
+// Each binary is loaded into a full memory image once, and every machine
+// running it maps that image copy-on-write, so a machine only costs the
+// pages it writes to. The image itself is only kept in the file, mapped
+// read-only. (Windows has no MAP_PRIVATE for us; it gets copies.)
+struct image {
+	const char *path; uint16_t load_at; // Where in memory the binary went
+	const uint8_t *data; // TOTAL_MEM bytes, as loaded
+	int fd; // Unlinked file holding data, -1 if none
+	struct image *next;
+};
+
+// Returns the image of the binary at path loaded at load_at, loading it the
+// first time it's asked for, or NULL if it can't be read or there's no
+// memory for it
+struct image *image_get(struct image **images, const char *path,
+		uint16_t load_at) {
+	for (struct image *img = *images; img; img = img->next)
+		if (strcmp(img->path, path) == 0 && img->load_at == load_at)
+			return img;
+	FILE *fp = fopen(path, "rb");
+	if (!fp) return NULL;
+	struct image *img = calloc(1, sizeof(struct image));
+	uint8_t *data = calloc(TOTAL_MEM, 1);
+	if (!img || !data) {
+		fclose(fp);
+		free(img);
+		free(data);
+		return NULL;
+	}
+	img->path = path;
+	img->load_at = load_at;
+	fread(data + load_at, TOTAL_MEM - load_at, 1, fp);
+	fclose(fp);
+	img->data = data;
+	img->fd = -1;
+#ifndef WIN32
+	// Once the file has it, read it back through the page cache the
+	// machines share instead of keeping a second copy
+	FILE *tmp = tmpfile();
+	if (tmp && fwrite(data, TOTAL_MEM, 1, tmp) == 1 && fflush(tmp) == 0) {
+		int fd = dup(fileno(tmp));
+		void *map = fd < 0 ? MAP_FAILED :
+			mmap(NULL, TOTAL_MEM, PROT_READ, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			img->fd = fd;
+			img->data = map;
+			free(data);
 		}
+		else if (fd >= 0) close(fd);
 	}
-	// If have arg, fileNameBuf is just argv[1]
-	else {
-		strcpy(fileNameBuf, argv[1]);
+	if (tmp) fclose(tmp);
+#endif
+	img->next = *images;
+	*images = img;
+	return img;
+}
+
+// A machine's own memory, starting out as the image. NULL if out of memory.
+uint8_t *image_map(const struct image *img) {
+#ifndef WIN32
+	if (img->fd >= 0) {
+		void *mem = mmap(NULL, TOTAL_MEM, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			img->fd, 0);
+		return mem == MAP_FAILED ? NULL : mem;
 	}
+#endif
+	uint8_t *mem = malloc(TOTAL_MEM);
+	if (mem) memcpy(mem, img->data, TOTAL_MEM);
+	return mem;
+}
 
-	// Handle command line: -unlimited
-	bool limit_enable = DEFAULT_LIMIT_ENABLE;
-	for (int i = 1; i < argc; i++) {
-		if (strcmp(argv[i], "-unlimited") == 0) {
-			limit_enable = false;
-			break;
-		}
+void image_unmap(const struct image *img, uint8_t *mem) {
+#ifndef WIN32
+	if (img->fd >= 0) {
+		munmap(mem, TOTAL_MEM);
+		return;
 	}
+#endif
+	free(mem);
+}
 
-	// Handle command line: -s[speed]
-	unsigned long limit_khz = DEFAULT_LIMIT_KHZ;
-	for (int i = 1; i < argc; i++) {
-		if (strncmp(argv[i], "-s", 2) == 0) {
-			unsigned long input = strtol(argv[i] + 2, NULL, 10);
-			if (input == 0) { // Also detects invalid input (strtol returns 0)
-				puts("Invalid speed (must be integer, not 0)");
-				return -1;
-			}
-			limit_khz = input;
-			break;
+void images_free(struct image *images) {
+	while (images) {
+		struct image *next = images->next;
+		if (images->fd >= 0) {
+#ifndef WIN32
+			munmap((void*)images->data, TOTAL_MEM);
+#endif
+			close(images->fd);
 		}
+		else free((void*)images->data);
+		free(images);
+		images = next;
 	}
+}
 
-	// =====
-	// INIT SIM
-	// =====
-	
-	// Init registers and memory
-	uint8_t mem[TOTAL_MEM] = {0};
-	uint8_t old_screen[SCREEN_LENGTH] = {0};
-	uint16_t reg_pc = PC_START;
-	uint8_t reg_ac = 0;
-	uint8_t reg_x = 0;
-	uint8_t reg_y = 0;
-	uint8_t reg_sr = 0;
-	uint8_t reg_sp = 0xFF;
-	bool halt = false; // Is the sim halted? (Pauses the sim if true)
-	bool no_pc_inc = false; // Hack to let opcodes tell sim not to inc pc once
-	struct sim_state sim_state = { .pc = &reg_pc, .ac = &reg_ac, .x = &reg_x,
-		.y = &reg_y, .sr = &reg_sr, .sp = &reg_sp, .mem = mem,
-		.halt = &halt, .no_pc_inc = &no_pc_inc };
-	
-	// Init opcodes
-	struct opcode opcodes[0x100] = {0};
-	construct_opcodes_table(opcodes);
- 
-	// Load binary into memory
-	{
-		FILE* fp;
-		fp = fopen(fileNameBuf, "rb");
-		if (!fp) {
-			perror("Cannot read input binary file");
-			return -1;
-		}
-		fread(mem + LOAD_START, TOTAL_MEM - LOAD_START, 1, fp);
-		fclose(fp);
+// Save states
+// One header plus all of memory, in host byte order, written in one go and
+// mapped straight back in on restore
+#define SNAPSHOT_MAGIC "6502SNAP"
+#define SNAPSHOT_VERSION 3
+struct snapshot {
+	char magic[8]; uint32_t version;
+	uint16_t pc; uint8_t ac; uint8_t x; uint8_t y; uint8_t sr; uint8_t sp;
+	uint8_t halt; uint8_t key_in_ff;
+	uint8_t key_consumed; uint8_t key_count; // Queue, oldest first
+	uint8_t keys[KEY_QUEUE_LENGTH];
+	uint32_t rng_state;
+	uint64_t ins_count; uint64_t cycles; uint64_t frames; uint64_t frame_cycles;
+	uint16_t timer_period; uint8_t timer_control; uint8_t timer_status;
+	uint8_t nmi; uint8_t waiting; uint64_t timer_at;
+	uint8_t mem[TOTAL_MEM];
+};
+
+bool save_snapshot(const char *path, const struct machine *m) {
+	struct snapshot *snap = calloc(1, sizeof(struct snapshot));
+	memcpy(snap->magic, SNAPSHOT_MAGIC, sizeof(snap->magic));
+	snap->version = SNAPSHOT_VERSION;
+	snap->pc = m->pc; snap->ac = m->ac; snap->x = m->x; snap->y = m->y;
+	snap->sr = m->sr; snap->sp = m->sp;
+	snap->halt = m->halt;
+	snap->key_in_ff = m->keys.in_ff;
+	snap->key_consumed = m->keys.consumed;
+	snap->key_count = m->keys.count;
+	for (int i = 0; i < m->keys.count; i++)
+		snap->keys[i] = m->keys.keys[(m->keys.head + i) % KEY_QUEUE_LENGTH];
+	snap->rng_state = m->rng_state;
+	snap->ins_count = m->ins_count;
+	snap->cycles = m->cycles;
+	snap->frames = m->frames;
+	snap->frame_cycles = m->frame_cycles;
+	snap->timer_period = m->irq.period;
+	snap->timer_control = m->irq.control;
+	snap->timer_status = m->irq.status;
+	snap->nmi = m->irq.nmi;
+	snap->waiting = m->irq.waiting;
+	snap->timer_at = m->irq.timer_at;
+	memcpy(snap->mem, m->mem, TOTAL_MEM);
+
+	FILE *fp = fopen(path, "wb");
+	bool ok = fp && fwrite(snap, sizeof(struct snapshot), 1, fp) == 1;
+	if (fp && fclose(fp) != 0) ok = false;
+	free(snap);
+	return ok;
+}
+
+// Returns false (and says why) if it's not a snapshot we understand
+bool load_snapshot(const char *path, struct machine *m) {
+	const struct snapshot *snap;
+#ifndef WIN32
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("Cannot read snapshot");
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size != sizeof(struct snapshot)) {
+		puts("Snapshot is the wrong size");
+		close(fd);
+		return false;
+	}
+	void *map = mmap(NULL, sizeof(struct snapshot), PROT_READ, MAP_PRIVATE,
+		fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("Cannot map snapshot");
+		return false;
 	}
+	snap = map;
+#else
+	struct snapshot *buf = malloc(sizeof(struct snapshot));
+	FILE *fp = fopen(path, "rb");
+	if (!fp || fread(buf, sizeof(struct snapshot), 1, fp) != 1) {
+		perror("Cannot read snapshot");
+		if (fp) fclose(fp);
+		free(buf);
+		return false;
+	}
+	fclose(fp);
+	snap = buf;
+#endif
 
-	// Init debug difflog
-	uint8_t *difflog_prev_mem;
-	uint8_t difflog_prev_ac = 0;
-	uint8_t difflog_prev_x = 0;
-	uint8_t difflog_prev_y = 0;
-	uint8_t difflog_prev_sr = 0;
-	//uint8_t difflog_prev_sp = 0xFF;
-	FILE *difflog_fp;
-	if (DEBUG_DIFFLOG) {
-		if (!(difflog_fp = fopen(DEBUG_DIFFLOG_FILE, "w"))) {
-			perror("Cannot write to difflog");
-			return -1;
+	bool ok = memcmp(snap->magic, SNAPSHOT_MAGIC, sizeof(snap->magic)) == 0 &&
+		snap->version == SNAPSHOT_VERSION;
+	if (ok) {
+		m->pc = snap->pc; m->ac = snap->ac; m->x = snap->x; m->y = snap->y;
+		m->sr = snap->sr; m->sp = snap->sp;
+		m->halt = snap->halt;
+		m->keys.in_ff = snap->key_in_ff;
+		m->keys.consumed = snap->key_consumed;
+		m->keys.head = 0;
+		m->keys.count = snap->key_count <= KEY_QUEUE_LENGTH ?
+			snap->key_count : KEY_QUEUE_LENGTH;
+		for (int i = 0; i < m->keys.count; i++) {
+			m->keys.keys[i] = snap->keys[i];
+			m->keys.times[i] = 0; // Latency unknown from here
 		}
-		difflog_prev_mem = malloc(TOTAL_MEM);
-		memcpy(difflog_prev_mem, mem, TOTAL_MEM);
+		m->rng_state = snap->rng_state;
+		m->ins_count = snap->ins_count;
+		m->cycles = snap->cycles;
+		m->frames = snap->frames;
+		m->frame_cycles = snap->frame_cycles;
+		m->irq = (struct interrupts){ .period = snap->timer_period,
+			.control = snap->timer_control, .status = snap->timer_status,
+			.nmi = snap->nmi, .waiting = snap->waiting,
+			.timer_at = snap->timer_at };
+		m->event_at = 0; // Work it out again
+		memcpy(m->mem, snap->mem, TOTAL_MEM);
+		memset(m->dirty, DIRTY_ALL, PAGE_COUNT);
 	}
+	else puts("Not a snapshot, or from another version");
 
-	// =====
-	// INIT LOOP 
-	// =====
+#ifndef WIN32
+	munmap(map, sizeof(struct snapshot));
+#else
+	free(buf);
+#endif
+	return ok;
+}
 
-	// Init main loop
-	bool running = true; // Is the entire app running? (Will quit if false)
+// Rewind
+// Every so often a checkpoint keeps the machine as it was then, along with
+// the old contents of each page written since the checkpoint before it.
+// Pages 0 and 1 ($FE/$FF and the stack) are written behind mem_write's back
+// so they always count as written. The oldest checkpoints go when the
+// buffer is full.
+struct rewind_checkpoint { struct machine state; int page_count; };
+struct rewind {
+	uint8_t *shadow; // Memory as of the newest checkpoint
+	struct rewind_checkpoint *checkpoints; // Ring, oldest first
+	int cp_capacity; int cp_first; int cp_count;
+	uint8_t (*pages)[PAGE_SIZE]; uint8_t *page_nums; // Ring, oldest first
+	int pool_capacity; int pool_first; int pool_count;
+};
 
-	// Init rendering
-	unsigned long long prev_frame_time = 0;
-	bool full_redraw = false;
+void rewind_free(struct rewind *rw) {
+	free(rw->shadow);
+	free(rw->checkpoints);
+	free(rw->pages);
+	free(rw->page_nums);
+}
 
-	// Init delayed start
-	unsigned long long init_time = get_clock_ns();
-	bool started = false;
+// Returns false if there's no memory for it
+bool rewind_init(struct rewind *rw, unsigned long kb) {
+	// A checkpoint holds at least 2 pages; there must always be room for
+	// a checkpoint with every page written, so small budgets get that much
+	size_t budget = kb * 1024;
+	size_t page_bytes = PAGE_SIZE + 1;
+	size_t least = 2 * (sizeof(struct rewind_checkpoint) + page_bytes) +
+		PAGE_COUNT * page_bytes;
+	if (budget < least) budget = least;
+	rw->cp_capacity = budget / (sizeof(struct rewind_checkpoint) +
+		2 * page_bytes);
+	if (rw->cp_capacity < 2) rw->cp_capacity = 2;
+	rw->pool_capacity = (budget - rw->cp_capacity *
+		sizeof(struct rewind_checkpoint)) / page_bytes;
+	if (rw->pool_capacity < PAGE_COUNT) rw->pool_capacity = PAGE_COUNT;
+	rw->shadow = malloc(TOTAL_MEM);
+	rw->checkpoints = malloc(rw->cp_capacity *
+		sizeof(struct rewind_checkpoint));
+	rw->pages = malloc(rw->pool_capacity * PAGE_SIZE);
+	rw->page_nums = malloc(rw->pool_capacity);
+	rw->cp_first = rw->cp_count = 0;
+	rw->pool_first = rw->pool_count = 0;
+	if (!rw->shadow || !rw->checkpoints || !rw->pages || !rw->page_nums) {
+		rewind_free(rw);
+		return false;
+	}
+	return true;
+}
 
-	// Init average speed
-	unsigned long long start_time = 0;
-	unsigned long long ins_count = 0;
-	bool avg_speed_done = false;
+// Forgets every checkpoint, for when the past no longer applies
+void rewind_forget(struct rewind *rw) {
+	rw->cp_first = rw->cp_count = 0;
+	rw->pool_first = rw->pool_count = 0;
+}
 
-	// Init speed limiting
-	unsigned long cycles_this_frame = 0;
-	unsigned long cycles_per_frame = (limit_khz * 1000) * // khz -> hz
-		((float)FRAME_INTERVAL / 1000 / 1000 / 1000); // ns -> s
-	
-	// Init stepping
-	bool on_breakpoint = false;
+struct rewind_checkpoint *rewind_nth(struct rewind *rw, int n) {
+	return &rw->checkpoints[(rw->cp_first + n) % rw->cp_capacity];
+}
 
-	// =====
-	// START MAIN LOOP
-	// =====
-	
-	while (running) {
-		// =====
-		// UPDATE
-		// =====
+// Nothing is older than the oldest checkpoint, so nothing needs its pages
+void rewind_drop_oldest(struct rewind *rw) {
+	rw->cp_first = (rw->cp_first + 1) % rw->cp_capacity;
+	rw->cp_count--;
+	struct rewind_checkpoint *oldest = rewind_nth(rw, 0);
+	rw->pool_first = (rw->pool_first + oldest->page_count) %
+		rw->pool_capacity;
+	rw->pool_count -= oldest->page_count;
+	oldest->page_count = 0;
+}
 
-		// Delayed start
-		if (!started && get_clock_ns() - init_time > START_DELAY) {
-			started = true;
-			start_time = get_clock_ns(); // Start counting average speed
+void rewind_checkpoint(struct rewind *rw, struct machine *m) {
+	int page_count = 0;
+	if (rw->cp_count == 0) { // First one just starts the shadow
+		memcpy(rw->shadow, m->mem, TOTAL_MEM);
+		for (int p = 0; p < PAGE_COUNT; p++) m->dirty[p] &= ~DIRTY_REWIND;
+	}
+	else {
+		m->dirty[0] |= DIRTY_REWIND;
+		m->dirty[1] |= DIRTY_REWIND;
+		for (int p = 0; p < PAGE_COUNT; p++)
+			page_count += m->dirty[p] & DIRTY_REWIND;
+		while (rw->cp_count == rw->cp_capacity ||
+				rw->pool_capacity - rw->pool_count < page_count)
+			rewind_drop_oldest(rw);
+		for (int p = 0; p < PAGE_COUNT; p++) {
+			if (!(m->dirty[p] & DIRTY_REWIND)) continue;
+			int i = (rw->pool_first + rw->pool_count++) % rw->pool_capacity;
+			rw->page_nums[i] = p;
+			memcpy(rw->pages[i], rw->shadow + p * PAGE_SIZE, PAGE_SIZE);
+			memcpy(rw->shadow + p * PAGE_SIZE, m->mem + p * PAGE_SIZE,
+				PAGE_SIZE);
+			m->dirty[p] &= ~DIRTY_REWIND;
 		}
+	}
+	struct rewind_checkpoint *cp = rewind_nth(rw, rw->cp_count++);
+	cp->state = *m;
+	cp->page_count = page_count;
+}
 
-		// Limit cycles per IO/frame, if enabled and we've done enough this I/O
-		bool limited = limit_enable && cycles_this_frame >= cycles_per_frame;
+// Puts the machine back to the newest checkpoint at or before ins_count,
+// forgetting the checkpoints after it. Returns false if that's too far back.
+bool rewind_to(struct rewind *rw, struct machine *m,
+		unsigned long long ins_count) {
+	int k = rw->cp_count - 1;
+	while (k >= 0 && rewind_nth(rw, k)->state.ins_count > ins_count) k--;
+	if (k < 0) return false;
 
-		// Step sim
-		if (started && !halt && !limited) {
-			// Count cycles per I/O frame
-			cycles_this_frame++;
+	// Undo what was written since the newest checkpoint...
+	// (Each page put back needs hashing again)
+	m->dirty[0] |= DIRTY_REWIND;
+	m->dirty[1] |= DIRTY_REWIND;
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		if (!(m->dirty[p] & DIRTY_REWIND)) continue;
+		memcpy(m->mem + p * PAGE_SIZE, rw->shadow + p * PAGE_SIZE, PAGE_SIZE);
+		m->dirty[p] = DIRTY_HASH;
+	}
 
-			// Random $FE
-			if (!DEBUG_DIFFLOG) mem[0xFE] = rand();
-			// Suppress random if difflog (decided by coin flip)
-			else mem[0xFE] = 7;
+	// ...then undo checkpoint by checkpoint until k is the newest
+	while (rw->cp_count - 1 > k) {
+		struct rewind_checkpoint *newest = rewind_nth(rw, rw->cp_count - 1);
+		for (int j = 0; j < newest->page_count; j++) {
+			int i = (rw->pool_first + --rw->pool_count) % rw->pool_capacity;
+			int p = rw->page_nums[i];
+			memcpy(m->mem + p * PAGE_SIZE, rw->pages[i], PAGE_SIZE);
+			memcpy(rw->shadow + p * PAGE_SIZE, rw->pages[i], PAGE_SIZE);
+			m->dirty[p] |= DIRTY_HASH;
+		}
+		rw->cp_count--;
+	}
 
-			// Fetch and decode opcode
-			uint8_t op = mem[reg_pc];
-			struct opcode decoded = opcodes[op];
-			
-			// Get instruction length
-			int length = 1;
-			if (decoded.addr_mode) length = decoded.addr_mode->length;
-
-			// Log instruction
-			if (DEBUG_LOG) {
-				printf("%llu: Stepping %04x: ", ins_count, reg_pc);
-				for (int i = 0; i < length; i++)
-					printf("%02x ", mem[reg_pc + i]);
-				puts("");
+	// Registers and counters, keeping our own memory
+	uint8_t *mem = m->mem;
+	uint8_t *dirty = m->dirty;
+	*m = rewind_nth(rw, k)->state;
+	m->mem = mem;
+	m->dirty = dirty;
+	return true;
+}
+
+// Command line helpers
+bool arg_flag(int argc, char **argv, const char *name) {
+	for (int i = 1; i < argc; i++)
+		if (strcmp(argv[i], name) == 0) return true;
+	return false;
+}
+// Returns the argument after "name", or NULL if not given
+char *arg_value(int argc, char **argv, const char *name) {
+	for (int i = 1; i < argc - 1; i++)
+		if (strcmp(argv[i], name) == 0) return argv[i + 1];
+	return NULL;
+}
+// Arms a breakpoint for every "name ADDR" given
+void arg_breakpoints(int argc, char **argv, const char *name, uint8_t *set,
+		int *count) {
+	for (int i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], name) != 0) continue;
+		uint16_t addr = parse_addr(argv[i + 1]);
+		if (!bp_test(set, addr)) bp_toggle(set, count, addr);
+	}
+}
+
+// Pushes PC and SR and jumps through the vector, like a real interrupt
+void interrupt_enter(struct machine *m, uint16_t vector) {
+	push(m->mem, &m->sp, m->pc >> 8);
+	push(m->mem, &m->sp, m->pc & 0xFF);
+	push(m->mem, &m->sp, bit_set(bit_set(m->sr, 4, 0), 5, 1)); // Not BRK
+	m->sr = bit_set(m->sr, 2, 1);
+	m->pc = i8to16(m->mem[vector + 1], m->mem[vector]);
+}
+
+// Called by the run loop once cycles reach event_at: fires the timer if it's
+// due, takes an interrupt if one is raised and allowed, and works out when to
+// look again. Returns false if the machine is asleep in WAI.
+bool machine_event(struct machine *m) {
+	struct interrupts *in = &m->irq;
+	if ((in->control & TIMER_ON) && m->cycles >= in->timer_at) {
+		in->status |= TIMER_FIRED;
+		if (in->control & TIMER_NMI) in->nmi = true;
+		if (in->control & TIMER_ONE_SHOT) in->control &= ~TIMER_ON;
+		else { // Next period, skipping any slept through
+			unsigned long period = timer_period(in);
+			in->timer_at += (m->cycles - in->timer_at) / period * period +
+				period;
+		}
+	}
+
+	bool irq = irq_raised(in);
+	if (in->nmi || (irq && !bit_get(m->sr, 2))) {
+		interrupt_enter(m, in->nmi ? 0xFFFA : 0xFFFE);
+		in->nmi = false;
+		in->waiting = false;
+	}
+	else if (irq) in->waiting = false; // WAI wakes up even if I is set
+
+	if (in->waiting) m->event_at = 0; // Keep the run loop stopped
+	else if (irq) m->event_at = m->cycles + 1; // Held off by I; keep asking
+	else if (in->control & TIMER_ON) m->event_at = in->timer_at;
+	else m->event_at = EVENT_NEVER;
+	return !in->waiting;
+}
+
+// Vblank, at the end of every frame
+void machine_vblank(struct machine *m) {
+	if (!(m->irq.control & VBLANK_ON)) return;
+	m->irq.status |= VBLANK_FIRED;
+	m->event_at = 0;
+}
+
+// Skips the cycles spent asleep in WAI, up to the timer or the end of the
+// frame (frame_left cycles away), whichever is first. Returns false if
+// nothing will wake it before then.
+bool machine_wait(struct machine *m, unsigned long long frame_left) {
+	unsigned long long skip = frame_left;
+	bool timer = (m->irq.control & TIMER_ON) &&
+		m->irq.timer_at - m->cycles < skip;
+	if (!timer && frame_left == EVENT_NEVER) return false; // No end in sight
+	if (timer) skip = m->irq.timer_at - m->cycles;
+	m->cycles += skip;
+	m->frame_cycles += skip;
+	return timer;
+}
+
+// Runs one instruction
+void sim_step(struct machine *m, struct sim_state s,
+		const struct opcode *opcodes) {
+	// Count cycles per I/O frame
+	m->frame_cycles++;
+
+	// Fetch and decode opcode
+	uint8_t op = m->mem[m->pc];
+	struct opcode decoded = opcodes[op];
+	
+	// Get instruction length
+	int length = 1;
+	if (decoded.addr_mode) length = decoded.addr_mode->length;
+
+	// Execute!
+	if (decoded.instruction)
+		decoded.instruction(decoded.addr_mode->get,
+			decoded.addr_mode->set, s);
+	else if (HALT_ON_INVALID) m->halt = true;
+
+	// Increment PC unless instruction said not to
+	if (!m->no_pc_inc) m->pc += length;
+	m->no_pc_inc = false; // Reset for next instruction
+
+	// Program took the key in $FF; next one please
+	if (m->keys.consumed) key_consume(&m->keys, m->mem);
+
+	// Count instruction for average speed
+	m->ins_count++;
+	m->cycles++;
+}
+
+// Debugger console
+// Command lines are read on their own thread, from stdin or a Unix socket, so
+// the window carries on while nobody is typing.
+#define CONSOLE_LINE_LENGTH 64
+#define CONSOLE_QUEUE_LENGTH 16
+struct console {
+	FILE *in; FILE *out; // Commands, and what we say back
+	bool wake_os; // Wake the OS layer for each line, if it might be waiting
+	pthread_t thread;
+	pthread_mutex_t lock; pthread_cond_t cond;
+	char lines[CONSOLE_QUEUE_LENGTH][CONSOLE_LINE_LENGTH];
+	int head; int count;
+	bool closed; // Nothing more to read
+};
+
+void *console_thread_main(void *arg) {
+	struct console *con = arg;
+	char line[CONSOLE_LINE_LENGTH];
+	while (fgets(line, sizeof(line), con->in)) {
+		pthread_mutex_lock(&con->lock);
+		if (con->count < CONSOLE_QUEUE_LENGTH) {
+			strcpy(con->lines[(con->head + con->count) % CONSOLE_QUEUE_LENGTH],
+				line);
+			con->count++;
+		}
+		pthread_cond_signal(&con->cond);
+		pthread_mutex_unlock(&con->lock);
+		if (con->wake_os) os_wake();
+	}
+	pthread_mutex_lock(&con->lock);
+	con->closed = true;
+	pthread_cond_signal(&con->cond);
+	pthread_mutex_unlock(&con->lock);
+	if (con->wake_os) os_wake();
+	return NULL;
+}
+
+void console_open(struct console *con, FILE *in, FILE *out, bool wake_os) {
+	*con = (struct console){ .in = in, .out = out, .wake_os = wake_os };
+	pthread_mutex_init(&con->lock, NULL);
+	pthread_cond_init(&con->cond, NULL);
+	pthread_create(&con->thread, NULL, console_thread_main, con);
+}
+
+#ifndef WIN32
+// Waits for one debugger to connect to a Unix socket at path, and uses it
+// for the console. Returns false if that can't be done.
+bool console_open_socket(struct console *con, const char *path,
+		bool wake_os) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) return false;
+	strcpy(addr.sun_path, path);
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) return false;
+	unlink(path); // Left over from an earlier run
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+			listen(listen_fd, 1) < 0) {
+		close(listen_fd);
+		return false;
+	}
+	printf("Waiting for the debugger on %s\n", path);
+	int fd = accept(listen_fd, NULL, NULL);
+	close(listen_fd);
+	unlink(path);
+	if (fd < 0) return false;
+	FILE *out = fdopen(dup(fd), "w");
+	setvbuf(out, NULL, _IOLBF, 0);
+	console_open(con, fdopen(fd, "r"), out, wake_os);
+	return true;
+}
+#endif
+
+// Stops the reading thread and closes the streams it was given (other than
+// stdin and stdout)
+void console_close(struct console *con) {
+#ifndef WIN32
+	if (con->in != stdin)
+		shutdown(fileno(con->in), SHUT_RDWR); // So its fgets sees the end
+	else
+#endif
+	pthread_cancel(con->thread); // Nothing else gets it out of stdin
+	pthread_join(con->thread, NULL);
+	if (con->in != stdin) fclose(con->in);
+	if (con->out != stdout) fclose(con->out);
+	pthread_mutex_destroy(&con->lock);
+	pthread_cond_destroy(&con->cond);
+}
+
+// Gets the next command line, if one has arrived. Returns false if not.
+bool console_poll(struct console *con, char *line) {
+	bool found = false;
+	pthread_mutex_lock(&con->lock);
+	if (con->count > 0) {
+		strcpy(line, con->lines[con->head]);
+		con->head = (con->head + 1) % CONSOLE_QUEUE_LENGTH;
+		con->count--;
+		found = true;
+	}
+	pthread_mutex_unlock(&con->lock);
+	return found;
+}
+
+bool console_closed(struct console *con) {
+	pthread_mutex_lock(&con->lock);
+	bool closed = con->closed && con->count == 0;
+	pthread_mutex_unlock(&con->lock);
+	return closed;
+}
+
+// Sleeps until a command line arrives, or ns pass
+void console_wait(struct console *con, unsigned long long ns) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ns += ts.tv_nsec;
+	ts.tv_sec += ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	pthread_mutex_lock(&con->lock);
+	if (con->count == 0 && !con->closed)
+		pthread_cond_timedwait(&con->cond, &con->lock, &ts);
+	pthread_mutex_unlock(&con->lock);
+}
+
+// Hot reload
+// A thread waits for the binary to be written (with inotify on Linux,
+// otherwise by looking at its modification time every WATCH_POLL_MS), so
+// the main loop only has to ask, even while it's idling after a halt.
+struct file_watch {
+	const char *path;
+	bool wake_os; // Wake the OS layer, if it might be waiting
+	pthread_t thread;
+	pthread_mutex_t lock; bool changed;
+};
+void watch_notify(struct file_watch *w) {
+	pthread_mutex_lock(&w->lock);
+	w->changed = true;
+	pthread_mutex_unlock(&w->lock);
+	if (w->wake_os) os_wake();
+}
+void *watch_thread_main(void *arg) {
+	struct file_watch *w = arg;
+#ifdef __linux__
+	// Watch the directory, since assemblers and editors often write a new
+	// file and rename it over the old one
+	char dir[256] = ".";
+	const char *name = strrchr(w->path, '/');
+	if (name && name - w->path >= (long)sizeof(dir)) {
+		puts("Cannot watch binary: its directory's path is too long");
+		return NULL;
+	}
+	if (name) {
+		memcpy(dir, w->path, name - w->path);
+		dir[name - w->path] = '\0';
+		if (!dir[0]) strcpy(dir, "/");
+		name++;
+	}
+	else name = w->path;
+	int fd = inotify_init();
+	if (fd < 0 ||
+			inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror("Cannot watch binary");
+		return NULL;
+	}
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length;
+	while ((length = read(fd, buf, sizeof(buf))) > 0) {
+		bool ours = false;
+		for (char *p = buf; p < buf + length;) {
+			struct inotify_event *e = (struct inotify_event*)p;
+			if (e->len && strcmp(e->name, name) == 0) ours = true;
+			p += sizeof(struct inotify_event) + e->len;
+		}
+		if (ours) watch_notify(w);
+	}
+	close(fd);
+#else
+	struct stat st;
+	time_t mtime = stat(w->path, &st) == 0 ? st.st_mtime : 0;
+	off_t size = mtime ? st.st_size : 0;
+	while (true) {
+		usleep(WATCH_POLL_MS * 1000);
+		if (stat(w->path, &st) != 0) continue; // Halfway through a rename
+		if (st.st_mtime == mtime && st.st_size == size) continue;
+		mtime = st.st_mtime;
+		size = st.st_size;
+		watch_notify(w);
+	}
+#endif
+	return NULL;
+}
+void watch_start(struct file_watch *w, const char *path, bool wake_os) {
+	*w = (struct file_watch){ .path = path, .wake_os = wake_os };
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_create(&w->thread, NULL, watch_thread_main, w);
+}
+// Has the file been written since last asked?
+bool watch_changed(struct file_watch *w) {
+	pthread_mutex_lock(&w->lock);
+	bool changed = w->changed;
+	w->changed = false;
+	pthread_mutex_unlock(&w->lock);
+	return changed;
+}
+
+// Puts the binary at path back into mem as a fresh start would have it,
+// rewriting only the pages that differ. Returns how many did, or -1 if it
+// can't be read.
+int reload_binary(const char *path, uint16_t load_at, uint8_t *mem,
+		uint8_t *dirty) {
+	FILE *fp = fopen(path, "rb");
+	if (!fp) return -1;
+	uint8_t *data = calloc(TOTAL_MEM, 1);
+	fread(data + load_at, TOTAL_MEM - load_at, 1, fp);
+	fclose(fp);
+	int pages = 0;
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		if (memcmp(mem + p * PAGE_SIZE, data + p * PAGE_SIZE, PAGE_SIZE) == 0)
+			continue;
+		memcpy(mem + p * PAGE_SIZE, data + p * PAGE_SIZE, PAGE_SIZE);
+		dirty[p] = DIRTY_ALL;
+		pages++;
+	}
+	free(data);
+	return pages;
+}
+
+// Screen images
+// Vector code where the compiler says the CPU has it (SSE2 on any x86-64,
+// AVX2 with -mavx2 or -march=native, NEON on ARM64), plain C otherwise. The
+// palette lookup is also built for AVX2 and SSSE3 on x86 with GCC or clang,
+// and picks one when it runs, since the build scripts don't ask for either.
+
+// Sets count pixels to color
+void pixels_fill(uint32_t *out, uint32_t color, int count) {
+	int i = 0;
+#if defined(__AVX2__)
+	__m256i color8 = _mm256_set1_epi32(color);
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_si256((__m256i*)(out + i), color8);
+#endif
+#if defined(__SSE2__)
+	__m128i color4 = _mm_set1_epi32(color);
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i*)(out + i), color4);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	uint32x4_t color4 = vdupq_n_u32(color);
+	for (; i + 4 <= count; i += 4) vst1q_u32(out + i, color4);
+#endif
+	for (; i < count; i++) out[i] = color;
+}
+
+// Looks up screen bytes i to count in palette (one per color)
+void palette_lookup_plain(const uint8_t *in, const uint32_t *palette,
+		uint32_t *out, int i, int count) {
+	for (; i < count; i++) out[i] = palette[in[i] & 0xf];
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PALETTE_X86
+// Gathers 8 pixels at a time
+__attribute__((target("avx2")))
+void palette_lookup_avx2(const uint8_t *in, const uint32_t *palette,
+		uint32_t *out, int count) {
+	int i = 0;
+	__m256i low8 = _mm256_set1_epi32(0xf);
+	for (; i + 8 <= count; i += 8) {
+		__m256i index = _mm256_and_si256(low8, _mm256_cvtepu8_epi32(
+			_mm_loadl_epi64((const __m128i*)(in + i))));
+		_mm256_storeu_si256((__m256i*)(out + i),
+			_mm256_i32gather_epi32((const int*)palette, index, 4));
+	}
+	palette_lookup_plain(in, palette, out, i, count);
+}
+
+// Shuffles each byte of 16 pixels out of the palette split into byte
+// planes, then interleaves them back into pixels
+__attribute__((target("ssse3")))
+void palette_lookup_ssse3(const uint8_t *in, const uint32_t *palette,
+		uint32_t *out, int count) {
+	int i = 0;
+	uint8_t bytes[4][COLOR_COUNT];
+	for (int c = 0; c < COLOR_COUNT; c++)
+		for (int b = 0; b < 4; b++) bytes[b][c] = palette[c] >> (8 * b);
+	__m128i planes[4];
+	for (int b = 0; b < 4; b++)
+		planes[b] = _mm_loadu_si128((const __m128i*)bytes[b]);
+	__m128i low16 = _mm_set1_epi8(0xf);
+	for (; i + 16 <= count; i += 16) {
+		__m128i index = _mm_and_si128(low16,
+			_mm_loadu_si128((const __m128i*)(in + i)));
+		__m128i b0 = _mm_shuffle_epi8(planes[0], index);
+		__m128i b1 = _mm_shuffle_epi8(planes[1], index);
+		__m128i b2 = _mm_shuffle_epi8(planes[2], index);
+		__m128i b3 = _mm_shuffle_epi8(planes[3], index);
+		__m128i lo01 = _mm_unpacklo_epi8(b0, b1);
+		__m128i hi01 = _mm_unpackhi_epi8(b0, b1);
+		__m128i lo23 = _mm_unpacklo_epi8(b2, b3);
+		__m128i hi23 = _mm_unpackhi_epi8(b2, b3);
+		__m128i *to = (__m128i*)(out + i);
+		_mm_storeu_si128(to + 0, _mm_unpacklo_epi16(lo01, lo23));
+		_mm_storeu_si128(to + 1, _mm_unpackhi_epi16(lo01, lo23));
+		_mm_storeu_si128(to + 2, _mm_unpacklo_epi16(hi01, hi23));
+		_mm_storeu_si128(to + 3, _mm_unpackhi_epi16(hi01, hi23));
+	}
+	palette_lookup_plain(in, palette, out, i, count);
+}
+#endif
+
+// Looks up count screen bytes in palette, with the best vector code the CPU
+// has
+void palette_lookup(const uint8_t *in, const uint32_t *palette,
+		uint32_t *out, int count) {
+	int i = 0;
+#if defined(PALETTE_X86)
+	if (__builtin_cpu_supports("avx2")) {
+		palette_lookup_avx2(in, palette, out, count);
+		return;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		palette_lookup_ssse3(in, palette, out, count);
+		return;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	// Loading 16 pixels 4 ways splits them into byte planes
+	uint8x16x4_t planes = vld4q_u8((const uint8_t*)palette);
+	uint8x16_t low16 = vdupq_n_u8(0xf);
+	for (; i + 16 <= count; i += 16) {
+		uint8x16_t index = vandq_u8(low16, vld1q_u8(in + i));
+		uint8x16x4_t pixels;
+		for (int b = 0; b < 4; b++)
+			pixels.val[b] = vqtbl1q_u8(planes.val[b], index);
+		vst4q_u8((uint8_t*)(out + i), pixels);
+	}
+#endif
+	palette_lookup_plain(in, palette, out, i, count);
+}
+
+// Turns the byte screen into 32-bit pixels from palette (one per color),
+// scale by scale each. Each row is built once, then copied down.
+void screen_expand(const uint8_t *screen, const uint32_t *palette,
+		uint32_t *out, int scale) {
+	int width = SCREEN_WIDTH * scale;
+	uint32_t pixels[SCREEN_WIDTH];
+	for (int y = 0; y < SCREEN_HEIGHT; y++) {
+		uint32_t *row = out + y * scale * width;
+		palette_lookup(screen + y * SCREEN_WIDTH, palette, pixels,
+			SCREEN_WIDTH);
+		for (int x = 0; x < SCREEN_WIDTH; x++)
+			pixels_fill(row + x * scale, pixels[x], scale);
+		for (int i = 1; i < scale; i++)
+			memcpy(row + i * width, row, width * sizeof(uint32_t));
+	}
+}
+
+// Which pixels of a row differ from old, one bit each in words of 64
+// (x = 0 in bit 0 of the first). Returns false if none do.
+#define ROW_WORDS ((SCREEN_WIDTH + 63) / 64)
+bool row_diff(const uint8_t *row, const uint8_t *old, uint64_t *diff) {
+	for (int w = 0; w < ROW_WORDS; w++) diff[w] = 0;
+	int i = 0;
+#if defined(__AVX2__)
+	for (; i + 32 <= SCREEN_WIDTH; i += 32) {
+		__m256i same = _mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i*)(row + i)),
+			_mm256_loadu_si256((const __m256i*)(old + i)));
+		diff[i / 64] |= (uint64_t)~(uint32_t)_mm256_movemask_epi8(same) <<
+			i % 64;
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= SCREEN_WIDTH; i += 16) {
+		__m128i same = _mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i*)(row + i)),
+			_mm_loadu_si128((const __m128i*)(old + i)));
+		diff[i / 64] |= (uint64_t)(~_mm_movemask_epi8(same) & 0xFFFF) <<
+			i % 64;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	// No movemask, so weigh each lane by its bit and add up each half
+	static const uint8_t weights[16] =
+		{ 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t weight = vld1q_u8(weights);
+	for (; i + 16 <= SCREEN_WIDTH; i += 16) {
+		uint8x16_t bits = vandq_u8(weight,
+			vmvnq_u8(vceqq_u8(vld1q_u8(row + i), vld1q_u8(old + i))));
+		diff[i / 64] |= (uint64_t)(vaddv_u8(vget_low_u8(bits)) |
+			vaddv_u8(vget_high_u8(bits)) << 8) << i % 64;
+	}
+#endif
+	for (; i < SCREEN_WIDTH; i++)
+		if (row[i] != old[i]) diff[i / 64] |= (uint64_t)1 << i % 64;
+	uint64_t any = 0;
+	for (int w = 0; w < ROW_WORDS; w++) any |= diff[w];
+	return any != 0;
+}
+
+// Draws the rows of a screen that changed since old (all of them if full),
+// with its top-left corner at left, top. Returns true if anything was drawn.
+bool render_screen(const uint8_t *screen, uint8_t *old, bool *dirty_rows,
+		bool full, int left, int top, unsigned long long *rects) {
+	bool dirty = false;
+	uint64_t diff[ROW_WORDS];
+	for (int y = 0; y < SCREEN_HEIGHT; y++) {
+		// Only rows the program changed, unless redraw is required
+		if (!dirty_rows[y] && !full) continue;
+		dirty_rows[y] = false;
+		const uint8_t *row = screen + y * SCREEN_WIDTH;
+		if (full) { // Every pixel
+			for (int w = 0; w < ROW_WORDS; w++) diff[w] = ~(uint64_t)0;
+			if (SCREEN_WIDTH % 64)
+				diff[ROW_WORDS - 1] = ((uint64_t)1 << SCREEN_WIDTH % 64) - 1;
+		}
+		else if (!row_diff(row, old + y * SCREEN_WIDTH, diff)) continue;
+		dirty = true; // So we know to present later
+		memcpy(old + y * SCREEN_WIDTH, row, SCREEN_WIDTH); // Update old
+
+		// Render only the pixels that changed, or all if redraw is required
+		for (int w = 0; w < ROW_WORDS; w++) {
+			uint64_t bits = diff[w];
+			for (int x = w * 64; bits; x++, bits >>= 1) {
+				if (!(bits & 1)) continue;
+				int color = row[x] & 0xf; // 0x0 to 0xf colors only
+				os_draw_rect(left + x * PIXEL_SIZE, top + y * PIXEL_SIZE,
+					PIXEL_SIZE, PIXEL_SIZE, colors, color);
+				(*rects)++;
 			}
+		}
+	}
+	return dirty;
+}
 
-			// Save PC for debugging purposes
-			uint16_t backup_pc = reg_pc;
+// Frame recording
+// The screen is copied into a pool at the end of every frame, and its own
+// thread scales, colors and writes it, so the disk never holds up the
+// emulator. Frames that find the pool full are dropped, unless told to wait.
+#define RECORD_POOL 64 // Frames waiting to be written
+#define RECORD_SIZE (SCREEN_WIDTH * PIXEL_SIZE) // Square, like the window
+struct recorder {
+	FILE *fp; bool y4m; // Else a stream of PPMs
+	uint8_t frames[RECORD_POOL][SCREEN_LENGTH]; int head; int count;
+	bool wait; bool closing;
+	unsigned long long written; unsigned long long dropped;
+	pthread_t thread; pthread_mutex_t lock; pthread_cond_t cond;
+};
 
-			// Check for trapped PC
-			uint16_t trapped_check_old_pc = reg_pc;
+// Writes one screen, scaled up to RECORD_SIZE square
+void record_frame(struct recorder *rec, const uint8_t *screen,
+		uint32_t *image, uint8_t *out) {
+	const int pixels = RECORD_SIZE * RECORD_SIZE;
+	uint32_t palette[COLOR_COUNT]; // Three bytes of whatever goes in the file
+	for (int c = 0; c < COLOR_COUNT; c++) {
+		float r = colors[c * 3 + 0], g = colors[c * 3 + 1];
+		float b = colors[c * 3 + 2];
+		uint8_t bytes[3];
+		if (rec->y4m) { // BT.601, studio range
+			bytes[0] = 16 + 65.481 * r + 128.553 * g + 24.966 * b + 0.5;
+			bytes[1] = 128 - 37.797 * r - 74.203 * g + 112.0 * b + 0.5;
+			bytes[2] = 128 + 112.0 * r - 93.786 * g - 18.214 * b + 0.5;
+		}
+		else for (int i = 0; i < 3; i++)
+			bytes[i] = colors[c * 3 + i] * 255 + 0.5;
+		palette[c] = bytes[0] | bytes[1] << 8 | (uint32_t)bytes[2] << 16;
+	}
+	screen_expand(screen, palette, image, PIXEL_SIZE);
+	for (int p = 0; p < pixels; p++) {
+		for (int i = 0; i < 3; i++) {
+			uint8_t byte = image[p] >> (8 * i);
+			if (rec->y4m) out[i * pixels + p] = byte; // Planar
+			else out[p * 3 + i] = byte;
+		}
+	}
+	if (rec->y4m) fputs("FRAME\n", rec->fp);
+	else fprintf(rec->fp, "P6\n%d %d\n255\n", RECORD_SIZE, RECORD_SIZE);
+	fwrite(out, pixels * 3, 1, rec->fp);
+}
 
-			// Execute!
-			if (decoded.instruction)
-				decoded.instruction(decoded.addr_mode->get,
-					decoded.addr_mode->set, sim_state);
-			else {
-				if (DEBUG_LOG) printf("Invalid opcode %02x\n", op);
-				if (HALT_ON_INVALID) halt = true;
+void *recorder_thread_main(void *arg) {
+	struct recorder *rec = arg;
+	uint32_t *image = malloc(RECORD_SIZE * RECORD_SIZE * sizeof(uint32_t));
+	uint8_t *out = malloc(RECORD_SIZE * RECORD_SIZE * 3);
+	pthread_mutex_lock(&rec->lock);
+	while (true) {
+		while (rec->count == 0 && !rec->closing)
+			pthread_cond_wait(&rec->cond, &rec->lock);
+		if (rec->count == 0) break;
+		pthread_mutex_unlock(&rec->lock);
+		// The frame at head is ours until count goes down
+		record_frame(rec, rec->frames[rec->head], image, out);
+		pthread_mutex_lock(&rec->lock);
+		rec->head = (rec->head + 1) % RECORD_POOL;
+		rec->count--;
+		rec->written++;
+		pthread_cond_signal(&rec->cond);
+	}
+	pthread_mutex_unlock(&rec->lock);
+	free(image);
+	free(out);
+	return NULL;
+}
+
+// .y4m for YUV4MPEG2, anything else for PPMs. Returns false if the file
+// can't be written.
+bool recorder_open(struct recorder *rec, const char *path, bool wait) {
+	if (!(rec->fp = fopen(path, "wb"))) return false;
+	const char *ext = strrchr(path, '.');
+	rec->y4m = ext && strcmp(ext, ".y4m") == 0;
+	rec->head = rec->count = 0;
+	rec->wait = wait;
+	rec->closing = false;
+	rec->written = rec->dropped = 0;
+	if (rec->y4m) {
+		fprintf(rec->fp, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+			RECORD_SIZE, RECORD_SIZE, 1000000000 / FRAME_INTERVAL);
+	}
+	pthread_mutex_init(&rec->lock, NULL);
+	pthread_cond_init(&rec->cond, NULL);
+	pthread_create(&rec->thread, NULL, recorder_thread_main, rec);
+	return true;
+}
+
+// Hands the screen to the writer
+void recorder_push(struct recorder *rec, const uint8_t *screen) {
+	pthread_mutex_lock(&rec->lock);
+	while (rec->wait && rec->count == RECORD_POOL)
+		pthread_cond_wait(&rec->cond, &rec->lock);
+	if (rec->count == RECORD_POOL) rec->dropped++;
+	else {
+		memcpy(rec->frames[(rec->head + rec->count) % RECORD_POOL], screen,
+			SCREEN_LENGTH);
+		rec->count++;
+		pthread_cond_signal(&rec->cond);
+	}
+	pthread_mutex_unlock(&rec->lock);
+}
+
+// Writes whatever is still waiting, then closes the file. Returns false if
+// any of it failed.
+bool recorder_close(struct recorder *rec) {
+	pthread_mutex_lock(&rec->lock);
+	rec->closing = true;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+	pthread_join(rec->thread, NULL);
+	bool ok = !ferror(rec->fp);
+	if (fclose(rec->fp) != 0) ok = false;
+	return ok;
+}
+
+// Runtime metrics
+// Added up a batch or a frame at a time, never per instruction, and written
+// out as one JSON line per period for a collector to pick up
+struct metrics {
+	FILE *fp; unsigned long long period; // NULL = off; period in ns
+	unsigned long long start; unsigned long long last; // Clock
+	unsigned long long last_ins; unsigned long long last_frames;
+	unsigned long long loop_time; // Clock at the top of the last loop
+	unsigned long long presents; unsigned long long rects;
+	unsigned long long events;
+	unsigned long long emulate_ns; unsigned long long idle_ns;
+	unsigned long long limited_ns;
+};
+
+#ifndef WIN32
+// Connects to a collector listening on a Unix socket. Returns NULL if it
+// isn't there.
+FILE *metrics_connect(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) return NULL;
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return NULL;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	signal(SIGPIPE, SIG_IGN); // A collector going away is just an error
+	return fdopen(fd, "w");
+}
+#endif
+
+// Writes what happened since the last line, then starts counting again.
+// Stops for good if the file or collector stops taking lines.
+void metrics_write(struct metrics *mt, const struct machine *m,
+		unsigned long long now) {
+	double secs = (double)(now - mt->last) / 1000000000;
+	unsigned long long ins = m->ins_count - mt->last_ins;
+	if (secs <= 0) return;
+	fprintf(mt->fp, "{\"time\":%.3f,\"ins\":%llu,\"ins_per_s\":%.0f,"
+		"\"mhz\":%.6f,\"frames\":%llu,\"presents\":%llu,\"rects\":%llu,"
+		"\"events\":%llu,\"emulate_ms\":%.3f,\"idle_ms\":%.3f,"
+		"\"limiter_duty\":%.4f,\"halted\":%s}\n",
+		(double)(now - mt->start) / 1000000000, ins, ins / secs,
+		ins / secs / 1000000, m->frames - mt->last_frames, mt->presents,
+		mt->rects, mt->events, (double)mt->emulate_ns / 1000000,
+		(double)mt->idle_ns / 1000000,
+		(double)mt->limited_ns / (now - mt->last), m->halt ? "true" : "false");
+	if (fflush(mt->fp) != 0) {
+		perror("Metrics stopped");
+		fclose(mt->fp);
+		mt->fp = NULL;
+	}
+	mt->last = now;
+	mt->last_ins = m->ins_count;
+	mt->last_frames = m->frames;
+	mt->presents = mt->rects = mt->events = 0;
+	mt->emulate_ns = mt->idle_ns = mt->limited_ns = 0;
+}
+
+// Timing histograms
+// Log-linear buckets: exact below 16 ns, then 16 buckets for every power of
+// two, so any percentile is within 1/16 of the truth
+#define HIST_SUB 16
+#define HIST_BUCKETS (61 * HIST_SUB)
+struct histogram {
+	const char *name;
+	unsigned long long counts[HIST_BUCKETS];
+	unsigned long long count; unsigned long long max;
+};
+
+void hist_add(struct histogram *h, unsigned long long ns) {
+	int bucket = ns;
+	if (ns >= HIST_SUB) {
+		int log = 4;
+		while (ns >> (log + 1)) log++;
+		bucket = (log - 3) * HIST_SUB + (ns >> (log - 4) & (HIST_SUB - 1));
+	}
+	h->counts[bucket]++;
+	h->count++;
+	if (ns > h->max) h->max = ns;
+}
+
+// Smallest time in the bucket the p-th sample (0 to 1) falls into
+unsigned long long hist_percentile(const struct histogram *h, double p) {
+	unsigned long long seen = 0;
+	unsigned long long want = p * h->count;
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->counts[b];
+		if (seen <= want) continue;
+		if (b < HIST_SUB) return b;
+		return (unsigned long long)(HIST_SUB + b % HIST_SUB) <<
+			(b / HIST_SUB - 1);
+	}
+	return h->max;
+}
+
+void hist_print(FILE *fp, const struct histogram *h) {
+	if (!h->count) return;
+	fprintf(fp, "%-16s %10.1f %10.1f %10.1f %10llu\n", h->name,
+		(double)hist_percentile(h, 0.5) / 1000,
+		(double)hist_percentile(h, 0.99) / 1000, (double)h->max / 1000,
+		h->count);
+}
+
+// Around the I/O block in the main loop
+struct timing {
+	struct histogram jitter; // Frame interval against FRAME_INTERVAL
+	struct histogram render; struct histogram present; struct histogram poll;
+	struct histogram emulate; // Running instructions, per frame
+	unsigned long long frame_emulate_ns; // So far this frame
+};
+
+// Debug features picked on the command line, and what they keep as they run
+struct debugger {
+	bool step; // Console after every instruction
+	bool break_trap; // Break when an instruction jumps to itself
+	bool break_ins_set; unsigned long long break_ins; // Break at this count
+	bool until_set; uint16_t until_pc; // Console's "run until"
+	struct breakpoints *breaks; bool armed; // Any breakpoints set at all?
+	struct coverage *cov; // Counting coverage?
+	bool unattended; // Nobody at the console; report breaks but carry on
+	bool paused; // Stopped for the console
+	FILE *out; // Where the console is
+	FILE *difflog_fp; uint8_t *difflog_prev_mem;
+	uint8_t difflog_prev_ac; uint8_t difflog_prev_x; uint8_t difflog_prev_y;
+	uint8_t difflog_prev_sr;
+};
+
+// Prints the instruction about to run
+void log_instruction(struct machine *m, const struct opcode *opcodes) {
+	const struct addr *addr_mode = opcodes[m->mem[m->pc]].addr_mode;
+	int length = addr_mode ? addr_mode->length : 1;
+	printf("%llu: Stepping %04x: ", m->ins_count, m->pc);
+	for (int i = 0; i < length; i++)
+		printf("%02x ", m->mem[m->pc + i]);
+	puts("");
+	if (!opcodes[m->mem[m->pc]].instruction)
+		printf("Invalid opcode %02x\n", m->mem[m->pc]);
+}
+
+// Debug difflog; compare RAM and registers with before the instruction at
+// pc, number ins, and print diffs
+// Takes the machine as it is now as the last logged state, so the next step
+// only logs what it changes
+void difflog_sync(struct debugger *d, const struct machine *m) {
+	memcpy(d->difflog_prev_mem, m->mem, TOTAL_MEM);
+	d->difflog_prev_ac = m->ac;
+	d->difflog_prev_x = m->x;
+	d->difflog_prev_y = m->y;
+	d->difflog_prev_sr = m->sr;
+}
+
+void difflog_step(struct debugger *d, struct machine *m, uint16_t pc,
+		unsigned long long ins) {
+	// Print differing memory addresses
+	for (int i = 0; i < TOTAL_MEM; i++) {
+		//if (i == 0xFE) continue; // Skip random
+		if (m->mem[i] == d->difflog_prev_mem[i]) continue;
+		fprintf(d->difflog_fp,
+			"%llu: Ins %02x @ %04x, Memory %04x, %02x -> %02x\n",
+			ins, m->mem[pc], pc, i, d->difflog_prev_mem[i], m->mem[i]);
+		d->difflog_prev_mem[i] = m->mem[i];
+	}
+
+	// Print differing registers
+	if (d->difflog_prev_ac != m->ac)
+		print_difflog(d->difflog_fp, ins, m->mem, pc, "AC",
+			d->difflog_prev_ac, m->ac);
+	if (d->difflog_prev_x != m->x)
+		print_difflog(d->difflog_fp, ins, m->mem, pc, "X",
+			d->difflog_prev_x, m->x);
+	if (d->difflog_prev_y != m->y)
+		print_difflog(d->difflog_fp, ins, m->mem, pc, "Y",
+			d->difflog_prev_y, m->y);
+	if (d->difflog_prev_sr != m->sr)
+		print_difflog(d->difflog_fp, ins, m->mem, pc, "SR",
+			d->difflog_prev_sr | 0x20, m->sr | 0x20);
+			// Workaround for 6502asm setting SR ignore bit
+
+	// Update old registers for next diff
+	d->difflog_prev_ac = m->ac;
+	d->difflog_prev_x = m->x;
+	d->difflog_prev_y = m->y;
+	d->difflog_prev_sr = m->sr;
+}
+
+// Checks breakpoints after the instruction at pc, number ins. Returns true
+// if the console is wanted.
+bool debug_check(struct debugger *d, struct machine *m, uint16_t pc,
+		unsigned long long ins) {
+	bool should_break = false;
+	if (d->cov) d->cov->exec[pc]++;
+	if (d->break_ins_set && ins == d->break_ins) {
+		fprintf(d->out, "Breaking at %llu\n", ins);
+		should_break = true;
+	}
+	if (d->break_trap && pc == m->pc) {
+		fprintf(d->out, "Breaking at %04x\n", pc);
+		should_break = true;
+	}
+	if (d->until_set && m->pc == d->until_pc) {
+		fprintf(d->out, "Reached %04x\n", m->pc);
+		d->until_set = false;
+		should_break = true;
+	}
+	if (d->armed && bp_test(d->breaks->pc, m->pc)) {
+		fprintf(d->out, "Breakpoint at %04x\n", m->pc);
+		should_break = true;
+	}
+	if (d->armed && d->breaks->hit) {
+		fprintf(d->out, "Watchpoint: %s %04x at %04x\n",
+			d->breaks->hit_kind == 'r' ? "read" : "write",
+			d->breaks->hit_addr, pc);
+		d->breaks->hit = false;
+		should_break = true;
+	}
+	if ((should_break || d->step) && !d->unattended) d->paused = true;
+	return d->paused;
+}
+
+// Run loop, built once for every mix of debug features so the plain one has
+// no debug checks at all. Runs until instruction number "until", a halt, or
+// the debugger wanting the console.
+#define RUN_LOG 1
+#define RUN_DIFFLOG 2
+#define RUN_DEBUG 4
+#define RUN_DEF(N, LOG, DIFFLOG, DEBUG) \
+	void run_##N(struct machine *m, struct sim_state s, \
+			const struct opcode *opcodes, struct debugger *d, \
+			unsigned long long until) { \
+		while (m->ins_count < until && !m->halt) { \
+			if (m->cycles >= m->event_at && !machine_event(m)) break; \
+			uint16_t pc = m->pc; \
+			unsigned long long ins = m->ins_count; \
+			if (LOG) log_instruction(m, opcodes); \
+			sim_step(m, s, opcodes); \
+			if (LOG && m->halt) puts("Halted."); \
+			if (DIFFLOG) difflog_step(d, m, pc, ins); \
+			if (DEBUG && debug_check(d, m, pc, ins)) break; \
+		} \
+	}
+RUN_DEF(plain, false, false, false)
+RUN_DEF(log, true, false, false)
+RUN_DEF(difflog, false, true, false)
+RUN_DEF(log_difflog, true, true, false)
+RUN_DEF(debug, false, false, true)
+RUN_DEF(log_debug, true, false, true)
+RUN_DEF(difflog_debug, false, true, true)
+RUN_DEF(log_difflog_debug, true, true, true)
+#undef RUN_DEF
+void (*const run_variants[])(struct machine*, struct sim_state,
+		const struct opcode*, struct debugger*, unsigned long long) = {
+	run_plain, run_log, run_difflog, run_log_difflog, run_debug, run_log_debug,
+	run_difflog_debug, run_log_difflog_debug
+};
+
+// Picks the run loop for the debug features in use
+int run_variant(struct debugger *d, bool log) {
+	int variant = 0;
+	if (log) variant |= RUN_LOG;
+	if (d->difflog_fp) variant |= RUN_DIFFLOG;
+	if (d->step || d->break_trap || d->break_ins_set || d->until_set ||
+			d->armed || d->cov)
+		variant |= RUN_DEBUG;
+	return variant;
+}
+
+// Where a batch of instructions meant to end at "until" has to stop instead,
+// so the next scripted key and rewind checkpoint land on the right
+// instruction
+unsigned long long batch_end(struct machine *m, struct input_script *script,
+		unsigned long long rewind_every, unsigned long long until) {
+	if (script->next < script->length &&
+			script->events[script->next].at < until)
+		until = script->events[script->next].at;
+	if (rewind_every) {
+		unsigned long long next = (m->ins_count / rewind_every + 1) *
+			rewind_every;
+		if (next < until) until = next;
+	}
+	return until;
+}
+
+// Tiles
+// Other machines sharing the window, each with a program of its own. They
+// run plain, a frame's worth of instructions at the end of every frame,
+// while the debug features all stay with the main machine.
+struct tile {
+	struct machine m; struct sim_state s; struct memory_map map;
+	const struct image *image; // Where m.mem came from
+	struct screen screen; uint8_t old_screen[SCREEN_LENGTH];
+	struct device random_dev; struct device keys_dev; struct device screen_dev;
+	struct device timer_dev;
+};
+
+// Returns false if there's no memory for it
+bool tile_load(struct tile *t, const struct image *image, uint32_t seed,
+		struct native_hooks *hooks, bool timer) {
+	*t = (struct tile){ .m = { .pc = PC_START, .sp = 0xFF,
+		.rng_state = seed ? seed : 0x6502 }, .image = image };
+	if (!(t->m.mem = image_map(image))) return false;
+	if (!(t->m.dirty = calloc(PAGE_COUNT, 1))) {
+		image_unmap(image, t->m.mem);
+		return false;
+	}
+
+	// Same devices as the main machine
+	for (int i = 0; i < SCREEN_HEIGHT; i++) t->screen.dirty_rows[i] = true;
+	t->random_dev = (struct device){ .read = random_read,
+		.state = &t->m.rng_state };
+	t->keys_dev = (struct device){ .read = keys_read, .write = keys_write,
+		.state = &t->m.keys };
+	t->screen_dev = (struct device){ .write = screen_write,
+		.state = &t->screen };
+	t->timer_dev = (struct device){ .read = timer_read, .write = timer_write };
+	map_device(&t->map, &t->random_dev, 0xFE, 0xFE, true, false);
+	map_device(&t->map, &t->keys_dev, 0xFF, 0xFF, true, true);
+	map_device(&t->map, &t->screen_dev, SCREEN_START,
+		SCREEN_START + SCREEN_LENGTH - 1, false, true);
+	if (timer) map_device(&t->map, &t->timer_dev, TIMER_START,
+		TIMER_START + 3, true, true);
+	t->s = sim_state_of(&t->m);
+	t->s.map = &t->map;
+	t->s.hooks = hooks;
+	return true;
+}
+
+void tile_free(struct tile *t) {
+	map_free(&t->map);
+	image_unmap(t->image, t->m.mem);
+	free(t->m.dirty);
+}
+
+bool tiles_halted(const struct tile *tiles, int count) {
+	for (int i = 0; i < count; i++)
+		if (!tiles[i].m.halt) return false;
+	return true;
+}
+
+// Where tile i goes, filling the window row by row
+int tile_left(int i, int columns) {
+	return i % columns * SCREEN_WIDTH * PIXEL_SIZE;
+}
+int tile_top(int i, int columns) {
+	return i / columns * SCREEN_HEIGHT * PIXEL_SIZE;
+}
+
+int our_main(int argc, char** argv) {
+	// =====
+	// INIT
+	// =====
+	
+	// Handle command line: -coverage-merge [out] [in...]
+	// Its own command, for adding up coverage from runs done in parallel
+	if (argc > 2 && strcmp(argv[1], "-coverage-merge") == 0) {
+		struct coverage *cov = calloc(1, sizeof(struct coverage));
+		bool ok = true;
+		for (int i = 3; i < argc && ok; i++) {
+			if (!(ok = coverage_merge(argv[i], cov)))
+				printf("Cannot read coverage from %s\n", argv[i]);
+		}
+		if (ok && !(ok = coverage_save(argv[2], cov)))
+			perror("Cannot write coverage");
+		if (ok) coverage_summary(stdout, cov);
+		free(cov);
+		return ok ? 0 : -1;
+	}
+
+	// For time to first instruction and first frame
+	unsigned long long launch_time = get_clock_ns();
+
+	// Handle command line: -headless (before we go make a window)
+	bool headless = arg_flag(argc, argv, "-headless");
+
+	// Handle command line: -tile [file] (needed for the window's size)
+	// Any number of times. Tiles fill the window in a square, or nearly.
+	int tile_count = 1; // Including the main machine
+	for (int i = 1; i < argc - 1; i++)
+		if (strcmp(argv[i], "-tile") == 0) tile_count++;
+	int tile_columns = 1;
+	while (tile_columns * tile_columns < tile_count) tile_columns++;
+	int tile_rows = (tile_count + tile_columns - 1) / tile_columns;
+
+	// Create window
+	if (!headless) {
+		os_create_window("6502", tile_columns * SCREEN_WIDTH * PIXEL_SIZE,
+			tile_rows * SCREEN_HEIGHT * PIXEL_SIZE);
+		os_create_colormap(colors, COLOR_COUNT);
+	}
+
+	// Handle command line, if no arg, ask with OS file dialog
+	char fileNameBuf[256];
+	if (argc < 2) {
+		// If no arg and true: fileNameBuf is set, continue
+		// If no arg and false, halt with instructions
+		if (headless || !os_choose_bin(fileNameBuf, sizeof(fileNameBuf))) {
+			puts("Usage: 6502 file.bin [options]");
+			puts("Options:");
+			printf("-unlimited: Run with no speed limiter (default: %s)\n",
+				DEFAULT_LIMIT_ENABLE ? "limited" : "unlimited");
+			printf("-s(speed_in_khz): Set speed limit (default: %d)\n",
+				DEFAULT_LIMIT_KHZ); 
+			puts("-headless: Run without a window, quit on halt");
+			puts("-max-ins (count): Quit after this many instructions");
+			puts("-virtual: Time frames by instruction count, not the clock");
+			puts("-seed (number): Seed the random $FE (default: time)");
+			puts("-input (file): Replay keypresses from an input script");
+			puts("-record-input (file): Record keypresses to an input script");
+			puts("-load-state (file): Resume from a snapshot");
+			puts("-load-at (addr): Load the binary here (default: 0600)");
+			puts("-watch: Start again whenever the binary is rebuilt");
+			puts("-pc (addr): Start running here (default: 0600)");
+			puts("-state-hash: Print a hash of registers and memory at halt");
+			puts("-save (file): Save a snapshot when the run ends");
+			puts("-rewind (count|frame): Checkpoint every count instructions "
+				"or every frame, for the debugger's b command");
+			printf("-rewind-kb (size): Rewind buffer budget (default: %d)\n",
+				DEFAULT_REWIND_KB);
+			puts("-timer: Map the timer and interrupt registers at $FFF0 "
+				"and allow WAI");
+			puts("-native-hook (addr:name[:zp]): Run a built-in C routine "
+				"(mul8, div8, memcpy, fill) for JSRs to addr");
+			puts("-break (addr): Break before running the instruction at addr");
+			puts("-watch-read (addr): Break after an instruction reads addr");
+			puts("-watch-write (addr): Break after an instruction writes addr");
+			puts("-break-ins (count): Break after this many instructions");
+			puts("-break-trap: Break when an instruction jumps to itself");
+			puts("-step: Step through every instruction");
+			puts("-log: Log every instruction run, and what compares compare");
+			puts("-difflog (file): Log every memory and register change");
+			puts("-hashlog (file): Log a state hash every frame");
+			puts("-hashlog-check (file): Stop where hashes differ from a log");
+			puts("-hashlog-every (count): Log every count instructions instead");
+			puts("-hashlog-from (count): Start logging at this instruction");
+			puts("-coverage (file): Count what runs, reads and writes each "
+				"address, adding to the file");
+			puts("6502 -coverage-merge (out) (in...): Add coverage files "
+				"together");
+			puts("-tile (file): Run another program beside this one in the "
+				"window (Tab moves the keyboard)");
+			puts("-record (file): Record every frame to a .y4m video, or a "
+				"stream of PPMs");
+			puts("-metrics (file): Write runtime metrics as JSON lines");
+			puts("-metrics-socket (path): Send them to a collector on a Unix "
+				"socket instead");
+			printf("-metrics-ms (period): How often to write them "
+				"(default: %d)\n", DEFAULT_METRICS_MS);
+			puts("-timing: Print frame timing percentiles and startup times "
+				"at exit");
+			puts("-debug-socket (path): Wait for a debugger on a Unix socket "
+				"and take commands from it instead of stdin");
+			return 0;
+		}
+	}
+	// If have arg, fileNameBuf is just argv[1]
+	else {
+		strcpy(fileNameBuf, argv[1]);
+	}
+
+	// Handle command line: -unlimited
+	bool limit_enable = DEFAULT_LIMIT_ENABLE;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-unlimited") == 0) {
+			limit_enable = false;
+			break;
+		}
+	}
+
+	// Handle command line: -s[speed]
+	unsigned long limit_khz = DEFAULT_LIMIT_KHZ;
+	for (int i = 1; i < argc; i++) {
+		// Careful not to catch -seed and friends
+		if (strncmp(argv[i], "-s", 2) == 0 && !isalpha(argv[i][2])) {
+			unsigned long input = strtol(argv[i] + 2, NULL, 10);
+			if (input == 0) { // Also detects invalid input (strtol returns 0)
+				puts("Invalid speed (must be integer, not 0)");
+				return -1;
 			}
+			limit_khz = input;
+			break;
+		}
+	}
 
-			// Increment PC unless instruction said not to
-			if (!no_pc_inc) reg_pc += length;
-			no_pc_inc = false; // Reset for next instruction
-
-			// Debug difflog; compare RAM, print diffs
-			if (DEBUG_DIFFLOG) {
-				// Print differing memory addresses
-				for (int i = 0; i < TOTAL_MEM; i++) {
-					//if (i == 0xFE) continue; // Skip random
-					if (mem[i] == difflog_prev_mem[i]) continue;
-					fprintf(difflog_fp,
-						"%llu: Ins %02x @ %04x, Memory %04x, %02x -> %02x\n",
-						ins_count, mem[backup_pc], backup_pc, i,
-						difflog_prev_mem[i], mem[i]);
-					difflog_prev_mem[i] = mem[i];
-				}
+	// Handle command line: -virtual
+	// Frames last exactly the speed limit's cycles per frame and everything
+	// else hangs off them, so a run is the same on any host, at any speed.
+	bool virtual_time = arg_flag(argc, argv, "-virtual");
+
+	// Handle command line: -max-ins [count]
+	unsigned long long max_ins = 0; // 0 = no budget
+	if (arg_value(argc, argv, "-max-ins"))
+		max_ins = strtoull(arg_value(argc, argv, "-max-ins"), NULL, 10);
+
+	// Handle command line: -input [file], -seed [number]
+	// The script can carry a seed too, but -seed wins.
+	struct input_script script = {0};
+	unsigned long seed = time(NULL);
+	bool seeded = false;
+	if (arg_value(argc, argv, "-seed")) {
+		seed = strtoul(arg_value(argc, argv, "-seed"), NULL, 10);
+		seeded = true;
+	}
+	if (arg_value(argc, argv, "-input") && !load_input_script(
+			arg_value(argc, argv, "-input"), &script, &seed, &seeded)) {
+		perror("Cannot read input script");
+		return -1;
+	}
+
+	// Handle command line: -record-input [file]
+	FILE *record_fp = NULL;
+	if (arg_value(argc, argv, "-record-input")) {
+		if (!(record_fp = fopen(arg_value(argc, argv, "-record-input"), "w"))) {
+			perror("Cannot write input script");
+			return -1;
+		}
+		fprintf(record_fp, "# 6502 input script\n# seed %lu\n", seed);
+	}
+
+	// Handle command line: -load-at [addr], -pc [addr]
+	// For binaries that aren't built for $0600, like full 64K test images
+	uint16_t load_at = LOAD_START;
+	uint16_t pc_start = PC_START;
+	if (arg_value(argc, argv, "-load-at"))
+		load_at = parse_addr(arg_value(argc, argv, "-load-at"));
+	if (arg_value(argc, argv, "-pc"))
+		pc_start = parse_addr(arg_value(argc, argv, "-pc"));
+
+	// =====
+	// INIT SIM
+	// =====
+	
+	// Init registers and memory
+	// Memory starts as the binary's image, shared copy-on-write with any tiles
+	// running it too
+	struct machine m = { .pc = pc_start, .sp = 0xFF,
+		.rng_state = seed ? seed : 0x6502 }; // xorshift can't take 0
+	struct image *images = NULL;
+	struct image *image = image_get(&images, fileNameBuf, load_at);
+	if (!image) {
+		perror("Cannot read input binary file");
+		return -1;
+	}
+	if (!(m.mem = image_map(image))) {
+		perror("Cannot map memory");
+		return -1;
+	}
+	if (!(m.dirty = calloc(PAGE_COUNT, 1))) {
+		perror("Cannot map memory");
+		return -1;
+	}
+	uint8_t *mem = m.mem;
+	uint8_t old_screen[SCREEN_LENGTH] = {0};
+	struct sim_state sim_state = sim_state_of(&m);
+	
+	// Init opcodes
+	struct opcode opcodes[0x100] = {0};
+	construct_opcodes_table(opcodes);
+
+	// Handle command line: -timer
+	// The timer's registers cover $FFF0-$FFF3 of the image, and WAI ($CB) is
+	// an invalid opcode without something to wake it
+	bool timer = arg_flag(argc, argv, "-timer");
+	if (timer) opcodes[0xCB] = (struct opcode){ ins_WAI, &addr_impl };
+
+	// Handle command line: -native-hook [addr:name[:zp]]
+	// Any number of times. JSR only looks for hooks if there are some.
+	struct native_hooks *hooks = NULL;
+	for (int i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "-native-hook") != 0) continue;
+		if (!hooks) hooks = calloc(1, sizeof(struct native_hooks));
+		if (!native_hook_add(hooks, argv[i + 1])) {
+			printf("Invalid native hook %s\n", argv[i + 1]);
+			return -1;
+		}
+	}
+	if (hooks) {
+		sim_state.hooks = hooks;
+		opcodes[0x20].instruction = ins_JSR_native;
+	}
+
+	// Handle command line: -log
+	// The main machine's compares print too; tiles are never logged
+	bool log = arg_flag(argc, argv, "-log");
+	struct opcode *logged_opcodes = NULL;
+	const struct opcode *main_opcodes = opcodes;
+	if (log) {
+		logged_opcodes = malloc(0x100 * sizeof(struct opcode));
+		construct_logged_opcodes_table(logged_opcodes, opcodes);
+		main_opcodes = logged_opcodes;
+	}
+	struct opcode *watched_opcodes = malloc(0x100 * sizeof(struct opcode));
+	construct_watched_opcodes_table(watched_opcodes, main_opcodes);
+
+	// Handle command line: -break, -watch-read, -watch-write [addr]
+	// Each can be given any number of times.
+	struct breakpoints *breaks = calloc(1, sizeof(struct breakpoints));
+	sim_state.breaks = breaks;
+	arg_breakpoints(argc, argv, "-break", breaks->pc, &breaks->pc_count);
+	arg_breakpoints(argc, argv, "-watch-read", breaks->read,
+		&breaks->watch_count);
+	arg_breakpoints(argc, argv, "-watch-write", breaks->write,
+		&breaks->watch_count);
+
+	// Handle command line: -step, -break-trap, -break-ins [count]
+	struct debugger dbg = { .breaks = breaks, .out = stdout,
+		.step = arg_flag(argc, argv, "-step"),
+		.break_trap = arg_flag(argc, argv, "-break-trap") };
+	if (arg_value(argc, argv, "-break-ins")) {
+		dbg.break_ins = strtoull(arg_value(argc, argv, "-break-ins"), NULL,
+			10);
+		dbg.break_ins_set = true;
+	}
+
+	// Handle command line: -coverage [file]
+	// Counts from an existing file carry on from where they were.
+	char *coverage_path = arg_value(argc, argv, "-coverage");
+	if (coverage_path) {
+		dbg.cov = sim_state.cov = calloc(1, sizeof(struct coverage));
+		FILE *fp = fopen(coverage_path, "rb");
+		if (fp) {
+			fclose(fp);
+			if (!coverage_merge(coverage_path, dbg.cov)) {
+				puts("Coverage file is damaged or not a coverage file");
+				return -1;
+			}
+		}
+	}
+
+	// Only pay for checks while something is armed; watchpoints and coverage
+	// need the watched address modes
+	dbg.armed = breaks->pc_count || breaks->watch_count;
+	const struct opcode *step_opcodes =
+		breaks->watch_count || dbg.cov ? watched_opcodes : main_opcodes;
+ 
+	// Handle command line: -tile [file]
+	// Tiles running the same binary share its image.
+	// The rest of the tiles get seeds after the main machine's
+	struct tile *tiles = calloc(tile_count, sizeof(struct tile));
+	for (int i = 1, n = 0; i < argc - 1; i++) {
+		if (strcmp(argv[i], "-tile") != 0) continue;
+		struct image *tile_image = image_get(&images, argv[i + 1],
+			LOAD_START);
+		if (!tile_image) {
+			perror("Cannot read tile binary file");
+			return -1;
+		}
+		if (!tile_load(&tiles[n], tile_image, seed + n + 1, hooks,
+				timer)) {
+			perror("Cannot map tile memory");
+			return -1;
+		}
+		n++;
+	}
+	int focus = 0; // Which tile gets the keyboard; 0 is the main machine
+
+	// Handle command line: -load-state [file]
+	// Resumed runs carry on counting; scripted input that is already past
+	// is skipped.
+	if (arg_value(argc, argv, "-load-state")) {
+		if (!load_snapshot(arg_value(argc, argv, "-load-state"), &m))
+			return -1;
+		script_seek(&script, m.ins_count);
+	}
+	unsigned long long first_ins = m.ins_count;
+
+	// Handle command line: -rewind [count|frame], -rewind-kb [size]
+	struct rewind rw;
+	unsigned long long rewind_every = 0; // Instructions, 0 = off or by frame
+	bool rewind_frames = false;
+	char *rewind_arg = arg_value(argc, argv, "-rewind");
+	if (rewind_arg) {
+		if (strcmp(rewind_arg, "frame") == 0) rewind_frames = true;
+		else if (!(rewind_every = strtoull(rewind_arg, NULL, 10))) {
+			puts("Invalid rewind interval (must be integer, not 0, or frame)");
+			return -1;
+		}
+		unsigned long kb = DEFAULT_REWIND_KB;
+		if (arg_value(argc, argv, "-rewind-kb"))
+			kb = strtoul(arg_value(argc, argv, "-rewind-kb"), NULL, 10);
+		if (!rewind_init(&rw, kb)) {
+			perror("Cannot allocate rewind buffer");
+			return -1;
+		}
+		rewind_checkpoint(&rw, &m);
+	}
+
+	// Handle command line: -difflog [file]
+	if (arg_value(argc, argv, "-difflog")) {
+		if (!(dbg.difflog_fp = fopen(arg_value(argc, argv, "-difflog"), "w"))) {
+			perror("Cannot write to difflog");
+			return -1;
+		}
+		dbg.difflog_prev_mem = malloc(TOTAL_MEM);
+		memcpy(dbg.difflog_prev_mem, mem, TOTAL_MEM);
+	}
+
+	// Handle command line: -hashlog [file], -hashlog-check [file],
+	// -hashlog-every [count], -hashlog-from [count]
+	struct state_hasher hasher = {0};
+	struct hashlog hl = {0};
+	if (arg_value(argc, argv, "-hashlog") &&
+			!(hl.fp = fopen(arg_value(argc, argv, "-hashlog"), "w"))) {
+		perror("Cannot write to hash log");
+		return -1;
+	}
+	if (arg_value(argc, argv, "-hashlog-check") && !(hl.check_fp =
+			fopen(arg_value(argc, argv, "-hashlog-check"), "r"))) {
+		perror("Cannot read hash log");
+		return -1;
+	}
+	if (arg_value(argc, argv, "-hashlog-every"))
+		hl.every = strtoull(arg_value(argc, argv, "-hashlog-every"), NULL,
+			10);
+	if (arg_value(argc, argv, "-hashlog-from"))
+		hl.from = strtoull(arg_value(argc, argv, "-hashlog-from"), NULL, 10);
+	hl.matched = hl.from;
+	if (hl.every) { // First line due at or after both from and now
+		hl.next = hl.from;
+		if (hl.next < m.ins_count)
+			hl.next += (m.ins_count - hl.next + hl.every - 1) / hl.every *
+				hl.every;
+	}
+	bool hashing = hl.fp || hl.check_fp;
+
+	// Init memory map: $FE, $FF, the screen and the timer are devices, the
+	// rest is RAM
+	struct memory_map map = {0};
+	struct screen screen;
+	for (int i = 0; i < SCREEN_HEIGHT; i++)
+		screen.dirty_rows[i] = true; // Whatever was loaded
+	struct device random_dev = { .state = &m.rng_state,
+		.read = dbg.difflog_fp ? fixed_random_read : random_read };
+	struct device keys_dev = { .read = keys_read, .write = keys_write,
+		.state = &m.keys };
+	struct device screen_dev = { .write = screen_write, .state = &screen };
+	map_device(&map, &random_dev, 0xFE, 0xFE, true, false);
+	map_device(&map, &keys_dev, 0xFF, 0xFF, true, true);
+	struct device timer_dev = { .read = timer_read, .write = timer_write };
+	map_device(&map, &screen_dev, SCREEN_START,
+		SCREEN_START + SCREEN_LENGTH - 1, false, true);
+	if (timer)
+		map_device(&map, &timer_dev, TIMER_START, TIMER_START + 3, true, true);
+	sim_state.map = &map;
+
+	// Pick the run loop with just the debug features asked for
+	void (*run)(struct machine*, struct sim_state, const struct opcode*,
+		struct debugger*, unsigned long long) =
+		run_variants[run_variant(&dbg, log)];
+	// Rewinding runs forward again without stopping (the checkpoint brings
+	// back the RNG state, so $FE reads the same as it did)
+	void (*replay)(struct machine*, struct sim_state, const struct opcode*,
+		struct debugger*, unsigned long long) =
+		run_variants[dbg.difflog_fp ? RUN_DIFFLOG : 0];
+
+	// Handle command line: -debug-socket [path]
+	// Otherwise the console is on stdin, unless headless (nobody there)
+	struct console con = {0}; // con.in set once it's open
+	bool console = false;
+	if (arg_value(argc, argv, "-debug-socket")) {
+#ifndef WIN32
+		if (!console_open_socket(&con, arg_value(argc, argv, "-debug-socket"),
+				!headless)) {
+			perror("Cannot open debugger socket");
+			return -1;
+		}
+		console = true;
+		dbg.out = con.out;
+#else
+		puts("Debugger sockets aren't supported on Windows");
+		return -1;
+#endif
+	}
+	else if (!headless) {
+		console_open(&con, stdin, stdout, true);
+		console = true;
+	}
+	dbg.unattended = !console;
+
+	// Handle command line: -watch
+	// Starts the binary again, in the same window, whenever it's rebuilt
+	// (Not with hash logs, which can't start over with it)
+	struct file_watch watch;
+	bool watching = arg_flag(argc, argv, "-watch");
+	if (watching && hashing) {
+		puts("-watch can't be used with -hashlog or -hashlog-check");
+		return -1;
+	}
+	if (watching) watch_start(&watch, fileNameBuf, !headless);
+
+	// Handle command line: -metrics [file], -metrics-socket [path],
+	// -metrics-ms [period]
+	struct metrics mt = {0};
+	unsigned long metrics_ms = DEFAULT_METRICS_MS;
+	if (arg_value(argc, argv, "-metrics-ms"))
+		metrics_ms = strtoul(arg_value(argc, argv, "-metrics-ms"), NULL, 10);
+	mt.period = (unsigned long long)(metrics_ms ? metrics_ms : 1) * 1000000;
+	if (arg_value(argc, argv, "-metrics")) {
+		if (!(mt.fp = fopen(arg_value(argc, argv, "-metrics"), "w"))) {
+			perror("Cannot write metrics");
+			return -1;
+		}
+	}
+	else if (arg_value(argc, argv, "-metrics-socket")) {
+#ifndef WIN32
+		if (!(mt.fp = metrics_connect(arg_value(argc, argv,
+				"-metrics-socket")))) {
+			perror("Cannot connect to metrics socket");
+			return -1;
+		}
+#else
+		puts("Metrics sockets aren't supported on Windows");
+		return -1;
+#endif
+	}
+	mt.start = mt.last = mt.loop_time = get_clock_ns();
+	mt.last_ins = m.ins_count;
+	mt.last_frames = m.frames;
+
+	// Handle command line: -record [file]
+	// Virtual time can wait for the writer, so nothing is ever dropped.
+	struct recorder *rec = NULL;
+	if (arg_value(argc, argv, "-record")) {
+		rec = malloc(sizeof(struct recorder));
+		if (!rec || !recorder_open(rec, arg_value(argc, argv, "-record"),
+				virtual_time)) {
+			perror("Cannot write recording");
+			free(rec);
+			return -1;
+		}
+	}
+
+	// Handle command line: -timing
+	struct timing *tm = NULL;
+	if (arg_flag(argc, argv, "-timing")) {
+		tm = calloc(1, sizeof(struct timing));
+		tm->jitter.name = "Frame jitter";
+		tm->render.name = "Render";
+		tm->present.name = "os_present";
+		tm->poll.name = "os_poll_event";
+		tm->emulate.name = "Emulate";
+	}
+
+	// =====
+	// INIT LOOP 
+	// =====
+
+	// Init main loop
+	bool running = true; // Is the entire app running? (Will quit if false)
+
+	// Init rendering
+	unsigned long long prev_frame_time = 0;
+	bool full_redraw = false;
+
+	// Init delayed start
+	// Wait for the window to be shown, or START_DELAY for OSes that don't say
+	unsigned long long init_time = get_clock_ns();
+	bool started = false;
+	bool exposed = false;
+	unsigned long long first_ins_time = 0; // Not moved by reloads
+	unsigned long long first_frame_time = 0;
+
+	// Init average speed
+	unsigned long long start_time = 0;
+	bool avg_speed_done = false;
+
+	// Init speed limiting
+	unsigned long cycles_per_frame = (limit_khz * 1000) * // khz -> hz
+		((float)FRAME_INTERVAL / 1000 / 1000 / 1000); // ns -> s
+	
+	// Init console stepping
+	unsigned long long pause_at = 0; // Pause at this ins_count, 0 = don't
+
+	// Init halt idling
+	bool halt_presented = false; // Has the final frame after halt been drawn?
+	bool woken = false; // Did the OS just wake us from idling?
+
+	// The run loop checks breakpoints after each instruction, so the one
+	// before the first instruction is checked here
+	if (dbg.armed && bp_test(breaks->pc, m.pc) && !dbg.unattended) {
+		fprintf(dbg.out, "Breakpoint at %04x\n", m.pc);
+		dbg.paused = true;
+	}
+
+	// =====
+	// START MAIN LOOP
+	// =====
+	
+	while (running) {
+		// =====
+		// UPDATE
+		// =====
 
-				// Print differing registers
-				if (difflog_prev_ac != reg_ac)
-					print_difflog(difflog_fp, ins_count, mem, backup_pc, "AC",
-						difflog_prev_ac, reg_ac);
-				if (difflog_prev_x != reg_x)
-					print_difflog(difflog_fp, ins_count, mem, backup_pc, "X",
-						difflog_prev_x, reg_x);
-				if (difflog_prev_y != reg_y)
-					print_difflog(difflog_fp, ins_count, mem, backup_pc, "Y",
-						difflog_prev_y, reg_y);
-				if (difflog_prev_sr != reg_sr)
-					print_difflog(difflog_fp, ins_count, mem, backup_pc, "SR",
-						difflog_prev_sr | 0x20, reg_sr | 0x20);
-						// Workaround for 6502asm setting SR ignore bit
-				/*if (difflog_prev_sp != reg_sp)
-					print_difflog(difflog_fp, ins_count, mem, backup_pc, "SP",
-						difflog_prev_sp, reg_sp);*/
-
-				// Update old registers for next diff
-				difflog_prev_ac = reg_ac;
-				difflog_prev_x = reg_x;
-				difflog_prev_y = reg_y;
-				difflog_prev_sr = reg_sr;
-				//difflog_prev_sp = reg_sp;
+		// Delayed start
+		if (!started && (headless || virtual_time || exposed ||
+				get_clock_ns() - init_time > START_DELAY)) {
+			started = true;
+			start_time = get_clock_ns(); // Start counting average speed
+			first_ins_time = start_time;
+		}
+
+		// Binary rebuilt: put it back in memory and start over, keeping the
+		// window, devices, breakpoints and options
+		if (watching && watch_changed(&watch)) {
+			int pages = reload_binary(fileNameBuf, load_at, mem, m.dirty);
+			if (pages < 0) perror("Cannot reload binary");
+			else {
+				m = (struct machine){ .pc = pc_start, .sp = 0xFF,
+					.rng_state = seed ? seed : 0x6502, .mem = mem,
+					.dirty = m.dirty };
+				script_seek(&script, 0);
+				if (rewind_arg) {
+					rewind_forget(&rw);
+					rewind_checkpoint(&rw, &m);
+				}
+				if (dbg.difflog_fp) difflog_sync(&dbg, &m);
+				first_ins = 0;
+				start_time = get_clock_ns();
+				avg_speed_done = halt_presented = false;
+				full_redraw = true;
+				printf("Reloaded %s, %d pages changed.\n", fileNameBuf, pages);
 			}
+		}
 
-			// Break if on breakpoint
-			bool addr_break = backup_pc == DEBUG_BREAKPOINT_VALUE;
-			bool ins_count_break = ins_count == DEBUG_BREAKPOINT_VALUE;
-			bool trapped_break = trapped_check_old_pc == reg_pc;
-			bool should_break = false;
-			switch (DEBUG_BREAKPOINT_MODE) {
-				case 0: should_break = addr_break; break;
-				case 1: should_break = ins_count_break; break;
-				case 2: should_break = trapped_break; break;
+		// Limit cycles per IO/frame, if enabled and we've done enough this I/O
+		// (Virtual frames end right when they have done enough instead)
+		bool limited = limit_enable && !virtual_time &&
+			m.frame_cycles >= cycles_per_frame;
+
+		// Metrics: time since the last loop went to waiting on the limiter
+		if (mt.fp) {
+			unsigned long long now = get_clock_ns();
+			if (limited && !m.halt && !dbg.paused)
+				mt.limited_ns += now - mt.loop_time;
+			mt.loop_time = now;
+		}
+
+		// Step sim, a batch of instructions at a time
+		if (started && !m.halt && !limited && !dbg.paused) {
+			// Scripted input due now
+			script_deliver(&script, &m);
+
+			// Run the rest of this frame's cycles, but stop for scripted
+			// input, rewind checkpoints, the instruction budget, the console,
+			// and every RUN_BATCH to look at I/O
+			unsigned long batch = RUN_BATCH;
+			if ((limit_enable || virtual_time) &&
+					cycles_per_frame - m.frame_cycles < batch)
+				batch = cycles_per_frame - m.frame_cycles;
+			unsigned long long until = batch_end(&m, &script, rewind_every,
+				m.ins_count + batch);
+			if (max_ins && first_ins + max_ins < until)
+				until = first_ins + max_ins;
+			if (pause_at && pause_at < until) until = pause_at;
+			if (hashing && hl.every && hl.next < until) until = hl.next;
+
+			// Execute!
+			unsigned long long before = m.ins_count;
+			bool clocked = mt.fp || tm;
+			unsigned long long run_start = clocked ? get_clock_ns() : 0;
+			run(&m, sim_state, step_opcodes, &dbg, until);
+			if (m.irq.waiting) // Asleep: on to the timer, or the next frame
+				machine_wait(&m, limit_enable || virtual_time ?
+					cycles_per_frame - m.frame_cycles : EVENT_NEVER);
+			if (clocked) {
+				unsigned long long ns = get_clock_ns() - run_start;
+				mt.emulate_ns += ns;
+				if (tm) tm->frame_emulate_ns += ns;
 			}
-			if (DEBUG_BREAKPOINT && should_break) {
-				switch (DEBUG_BREAKPOINT_MODE) {
-					case 0:
-					case 2:
-						printf("Breaking at %04x\n", backup_pc);
-						break;
-					case 1:
-						printf("Breaking at %llu\n", ins_count);
-						break;
+
+			// Hash log line, if due
+			// Diverging pauses at the console, or ends the run, leaving the
+			// machine as it was for the report
+			if (hashing && hl.every && m.ins_count >= hl.next) {
+				hl.next += hl.every;
+				if (!hashlog_step(&hl, &hasher, &m)) {
+					if (console) dbg.paused = true;
+					else running = false;
 				}
-				on_breakpoint = true;
 			}
 
-			// Let user step through instructions, or coredump
-			if (DEBUG_STEP || (DEBUG_BREAKPOINT && on_breakpoint)) {
-				while (true) {
-					char cmd[32];
-					fgets(cmd, 32, stdin);
-					if (cmd[0] == '\n') break;
-					else if (cmd[0] == 'c') {
-						uint16_t begin = DEBUG_COREDUMP_START;
-						uint16_t end = DEBUG_COREDUMP_END;
-						char *split = strtok(cmd, " ");
+			// Rewind checkpoint, if due
+			if (rewind_every && m.ins_count != before &&
+					m.ins_count % rewind_every == 0)
+				rewind_checkpoint(&rw, &m);
+
+			// Done the console's step or "run (count)"
+			// (Unless a breakpoint got there first, which calls it off)
+			if (dbg.paused) {
+				pause_at = 0;
+				dbg.until_set = false;
+			}
+			else if (pause_at && m.ins_count >= pause_at) {
+				pause_at = 0;
+				dbg.paused = true;
+				fprintf(dbg.out, "Paused at %04x, instruction %llu\n", m.pc,
+					m.ins_count);
+			}
+		}
+
+		// =====
+		// DEBUGGER
+		// =====
+
+		// Commands arrive on the console's own thread, so the window keeps
+		// going while we wait for them, and "run" goes at full speed
+		char cmd[CONSOLE_LINE_LENGTH];
+		while (console && console_poll(&con, cmd)) {
+			if (cmd[0] == '\n') {
+				// Step one instruction when paused, pause when running
+				if (dbg.paused) {
+					pause_at = m.ins_count + 1;
+					dbg.paused = false;
+				}
+				else {
+					dbg.paused = true;
+					fprintf(dbg.out, "Paused at %04x, instruction %llu\n",
+						m.pc, m.ins_count);
+				}
+			}
+			else if (cmd[0] == 'c') {
+				uint16_t begin = DEBUG_COREDUMP_START;
+				uint16_t end = DEBUG_COREDUMP_END;
+				char *split = strtok(cmd, " ");
+				if (split) {
+					split = strtok(NULL, " ");
+					if (split) {
+						begin = strtol(split, NULL, 16);
+						end = begin;
+						split = strtok(NULL, " ");
 						if (split) {
-							split = strtok(NULL, " ");
-							if (split) {
-								begin = strtol(split, NULL, 16);
-								end = begin;
-								split = strtok(NULL, " ");
-								if (split) {
-									end = strtol(split, NULL, 16);
-								}
-							}
+							end = strtol(split, NULL, 16);
 						}
-						coredump(sim_state, begin, end);
 					}
-					else if (cmd[0] == 'r') on_breakpoint = false;
 				}
+				coredump(dbg.out, sim_state, begin, end);
+			}
+			else if (strncmp(cmd, "run", 3) == 0) {
+				// run (count), run until (addr): carry on at full speed,
+				// and pause again after count instructions or at addr
+				char *split = strtok(cmd, " ");
+				if (split) split = strtok(NULL, " ");
+				if (split && strcmp(split, "until") == 0) {
+					split = strtok(NULL, " ");
+					if (!split) {
+						fputs("Usage: run until (addr)\n", dbg.out);
+						continue;
+					}
+					dbg.until_pc = parse_addr(split);
+					dbg.until_set = true;
+				}
+				else if (split && strtoull(split, NULL, 10))
+					pause_at = m.ins_count + strtoull(split, NULL, 10);
+				dbg.paused = false;
+			}
+			else if (cmd[0] == 'r') dbg.paused = false;
+			else if (cmd[0] == 'p' || cmd[0] == 'w') {
+				// p, wr, ww (addr): toggle a breakpoint, or a read or
+				// write watchpoint
+				uint8_t *set = breaks->pc;
+				int *count = &breaks->pc_count;
+				const char *name = "Breakpoint";
+				if (cmd[0] == 'w') {
+					set = cmd[1] == 'r' ? breaks->read : breaks->write;
+					count = &breaks->watch_count;
+					name = cmd[1] == 'r' ? "Read watchpoint" :
+						"Write watchpoint";
+				}
+				char *split = strtok(cmd, " ");
+				if (split) split = strtok(NULL, " ");
+				if (!split || (cmd[0] == 'w' &&
+						cmd[1] != 'r' && cmd[1] != 'w')) {
+					fputs("Usage: p (addr), wr (addr), ww (addr)\n",
+						dbg.out);
+					continue;
+				}
+				uint16_t addr = parse_addr(split);
+				fprintf(dbg.out, "%s at %04x %s\n", name, addr,
+					bp_toggle(set, count, addr) ? "set" : "cleared");
+				dbg.armed = breaks->pc_count || breaks->watch_count;
+				step_opcodes = breaks->watch_count || dbg.cov ?
+					watched_opcodes : main_opcodes;
+			}
+			else if (cmd[0] == 'h') {
+				fprintf(dbg.out, "State hash at instruction %llu: %016llx\n",
+					m.ins_count, (unsigned long long)state_hash(&hasher, &m));
+			}
+			else if (cmd[0] == 'l') {
+				bp_list(dbg.out, "Breakpoints", breaks->pc);
+				bp_list(dbg.out, "Read watchpoints", breaks->read);
+				bp_list(dbg.out, "Write watchpoints", breaks->write);
+			}
+			else if (cmd[0] == 'b') {
+				// Back to an earlier instruction count: restore the
+				// checkpoint before it, then run forward to it
+				// (Scripted input is replayed, live input isn't)
+				unsigned long long target = strtoull(cmd + 1, NULL,
+					10);
+				if (!rewind_arg) {
+					fputs("Rewind not enabled (use -rewind)\n", dbg.out);
+					continue;
+				}
+				if (target > m.ins_count ||
+						!rewind_to(&rw, &m, target)) {
+					fputs("Can't rewind that far\n", dbg.out);
+					continue;
+				}
+				script_seek(&script, m.ins_count);
+				if (dbg.difflog_fp) difflog_sync(&dbg, &m); // Only the replay
+				while (m.ins_count < target && !m.halt) {
+					script_deliver(&script, &m);
+					unsigned long long until = batch_end(&m, &script,
+						rewind_every, target);
+					if (virtual_time && m.ins_count + cycles_per_frame -
+							m.frame_cycles < until)
+						until = m.ins_count + cycles_per_frame -
+							m.frame_cycles;
+					unsigned long long before = m.ins_count;
+					replay(&m, sim_state, opcodes, &dbg, until);
+					if (m.irq.waiting && !machine_wait(&m, virtual_time ?
+							cycles_per_frame - m.frame_cycles : EVENT_NEVER) &&
+							!virtual_time)
+						break; // Only a frame can wake it, and those were live
+					if (virtual_time &&
+							m.frame_cycles >= cycles_per_frame) {
+						m.frame_cycles = 0;
+						m.frames++;
+						machine_vblank(&m);
+					}
+					if (rewind_every && m.ins_count != before &&
+							m.ins_count % rewind_every == 0)
+						rewind_checkpoint(&rw, &m);
+				}
+				fprintf(dbg.out, "Rewound to %llu\n", m.ins_count);
+				full_redraw = true; // Screen came back behind its device
+				coredump(dbg.out, sim_state, DEBUG_COREDUMP_START,
+					DEBUG_COREDUMP_END);
 			}
-
-			// Log halt
-			if (DEBUG_LOG && halt)
-				puts("Halted.");
-
-			// Count instruction for average speed
-			ins_count++;
 		}
+		if (console && console_closed(&con)) { // Nobody left to ask
+			console = false;
+			dbg.unattended = true;
+			dbg.paused = false;
+			pause_at = 0;
+		}
+
+		// Breakpoints may have changed
+		run = run_variants[run_variant(&dbg, log)];
 
-		// Run I/O every X nanoseconds, or if redraw is required
-		unsigned long long new_frame_time = get_clock_ns();
-		if (new_frame_time - prev_frame_time > FRAME_INTERVAL || full_redraw) {
-			prev_frame_time = new_frame_time;
+		// Run I/O every X nanoseconds (or every frame's worth of cycles in
+		// virtual time, unless halted or paused), or if redraw is required
+		bool new_frame = virtual_time && !m.halt && !dbg.paused ?
+			m.frame_cycles >= cycles_per_frame :
+			get_clock_ns() - prev_frame_time > FRAME_INTERVAL;
+		bool io_frame = new_frame || full_redraw || woken;
+		if (io_frame) {
+			unsigned long long frame_start = get_clock_ns();
+			if (tm && new_frame) {
+				// How far off FRAME_INTERVAL this frame came, either way
+				if (!virtual_time && !m.halt && prev_frame_time) {
+					long long off = (long long)(frame_start -
+						prev_frame_time) - FRAME_INTERVAL;
+					hist_add(&tm->jitter, off < 0 ? -off : off);
+				}
+				hist_add(&tm->emulate, tm->frame_emulate_ns);
+				tm->frame_emulate_ns = 0;
+			}
+			prev_frame_time = frame_start;
+			woken = false;
 
 			// Reset cycles limiter for next I/O frame
-			cycles_this_frame = 0;
+			// Extra I/O for redraws can't cut a virtual frame short, or the
+			// run would depend on when the OS sent us expose events
+			// (Nor can a pause at the console)
+			if ((new_frame || !virtual_time) && !dbg.paused) {
+				m.frame_cycles = 0;
+				m.frames++;
+				machine_vblank(&m);
+				if (rec) recorder_push(rec, mem + SCREEN_START);
+				if (hashing && !hl.every && m.ins_count >= hl.from &&
+						!hashlog_step(&hl, &hasher, &m)) {
+					if (console) dbg.paused = true;
+					else running = false;
+				}
+
+				// Tiles keep up a frame at a time, and only with real frames,
+				// so expose and wake I/O doesn't speed them up
+				for (int i = 0; i < tile_count - 1 && new_frame; i++) {
+					struct tile *t = &tiles[i];
+					t->m.frame_cycles = 0;
+					t->m.frames++;
+					machine_vblank(&t->m);
+					while (!t->m.halt && t->m.frame_cycles < cycles_per_frame) {
+						run_plain(&t->m, t->s, opcodes, &dbg, t->m.ins_count +
+							cycles_per_frame - t->m.frame_cycles);
+						if (t->m.irq.waiting) machine_wait(&t->m,
+							cycles_per_frame - t->m.frame_cycles);
+					}
+				}
+				if (rewind_frames && !m.halt) rewind_checkpoint(&rw, &m);
+			}
 
 			// =====
 			// RENDER
 			// =====
 			
 			bool dirty = false;
-			for (int i = 0; i < SCREEN_LENGTH; i++) {
-				// Render only if dirty, or if redraw is required
-				uint8_t new_pix = mem[SCREEN_START + i];
-				if (old_screen[i] == new_pix && !full_redraw) continue;
-				dirty = true; // So we know to present later
-				old_screen[i] = new_pix; // Update old screen buffer
-
-				// Get pixel details
-				int x = i % SCREEN_WIDTH;
-				int y = i / SCREEN_WIDTH;
-				int color = new_pix & 0xf; // 0x0 to 0xf colors only
-
-				// Render
-				os_draw_rect(x * PIXEL_SIZE, y * PIXEL_SIZE, PIXEL_SIZE,
-					PIXEL_SIZE, colors, color);
+			unsigned long long render_start = tm ? get_clock_ns() : 0;
+			if (!headless) {
+				dirty = render_screen(mem + SCREEN_START, old_screen,
+					screen.dirty_rows, full_redraw, 0, 0, &mt.rects);
+				for (int i = 0; i < tile_count - 1; i++) {
+					struct tile *t = &tiles[i];
+					if (render_screen(t->m.mem + SCREEN_START, t->old_screen,
+							t->screen.dirty_rows, full_redraw,
+							tile_left(i + 1, tile_columns),
+							tile_top(i + 1, tile_columns), &mt.rects))
+						dirty = true;
+				}
+			}
+			if (tm && !headless)
+				hist_add(&tm->render, get_clock_ns() - render_start);
+			if (dirty) {
+				unsigned long long present_start = tm ? get_clock_ns() : 0;
+				os_present();
+				if (tm) hist_add(&tm->present, get_clock_ns() - present_start);
+				if (!first_frame_time) first_frame_time = get_clock_ns();
+				mt.presents++;
 			}
-			if (dirty) os_present();
 			full_redraw = false;
+			if (m.halt && tiles_halted(tiles, tile_count - 1) && !headless)
+				halt_presented = true;
+		}
 
-			// =====
-			// HANDLE EVENTS
-			// =====
+		// =====
+		// HANDLE EVENTS
+		// =====
 
+		// Every I/O frame, and also as soon as the OS layer has input for us
+		// so keys don't wait for the next frame
+		if (!headless && (io_frame || os_event_pending())) {
 			struct event e;
+			unsigned long long poll_start = tm ? get_clock_ns() : 0;
 			while (os_poll_event(&e)) {
+				mt.events++;
 				switch (e.type) {
 					case ET_KEYPRESS:
-						mem[0xFF] = e.kp_key; // Put ASCII into memory
+						// Tab moves the keyboard to the next tile
+						if (tile_count > 1 && e.kp_key == '\t') {
+							focus = (focus + 1) % tile_count;
+							printf("Keyboard: tile %d\n", focus);
+							break;
+						}
+						if (focus > 0) {
+							struct tile *t = &tiles[focus - 1];
+							key_push(&t->m.keys, t->m.mem, e.kp_key,
+								e.time_ns);
+							break;
+						}
+
+						// Put ASCII into memory, or queue it behind $FF
+						key_push(&m.keys, mem, e.kp_key, e.time_ns);
+						if (record_fp) fprintf(record_fp, "%llu %02x\n",
+							m.ins_count, (uint8_t)e.kp_key);
 						break;
 					case ET_EXPOSE:
 						full_redraw = true; // Next update will be an I/O frame
+						exposed = true; // Window is up; start
 						// FIXME: Getting too many expose events will make sim
 						// too fast!
 						break;
 					default: break;
 				}
 			}
+			if (tm) hist_add(&tm->poll, get_clock_ns() - poll_start);
 
 			if (os_should_exit()) running = false;
 		}
@@ -941,20 +3614,81 @@ int our_main(int argc, char** argv) {
 		// (Not sure if needed...)
 		//usleep(0);
 
+		// Paused at the console: sleep until the next frame is due or a
+		// command comes in
+		if (dbg.paused && running) {
+			unsigned long long since = get_clock_ns() - prev_frame_time;
+			if (since < FRAME_INTERVAL) {
+				console_wait(&con, FRAME_INTERVAL - since);
+				if (mt.fp) mt.idle_ns += get_clock_ns() - prev_frame_time -
+					since;
+			}
+		}
+
+		// Asleep in WAI with only the next frame's vblank to wake it (no
+		// timer, and frames in real time without the limiter): sleep until
+		// that's due instead of spinning
+		if (m.irq.waiting && !(m.irq.control & TIMER_ON) && !m.halt &&
+				!dbg.paused && !limit_enable && !virtual_time && running) {
+			unsigned long long since = get_clock_ns() - prev_frame_time;
+			if (since < FRAME_INTERVAL) {
+				if (headless) usleep((FRAME_INTERVAL - since) / 1000);
+				else os_wait_event(FRAME_INTERVAL - since);
+				if (mt.fp) mt.idle_ns += get_clock_ns() - prev_frame_time -
+					since;
+			}
+		}
+
+		// Nothing can change once halted and drawn, so sleep until the OS has
+		// an event for us (expose, keypress, close) instead of spinning, or
+		// until the next metrics line is due
+		if (halt_presented && avg_speed_done && running) {
+			unsigned long long idle_start = get_clock_ns();
+			unsigned long long timeout = 0; // No limit
+			if (mt.fp) timeout = mt.last + mt.period > idle_start ?
+				mt.last + mt.period - idle_start : 1;
+			os_wait_event(timeout);
+			if (mt.fp) mt.idle_ns += get_clock_ns() - idle_start;
+			woken = true;
+		}
+
+		// Metrics line, if one is due
+		if (mt.fp && get_clock_ns() - mt.last >= mt.period)
+			metrics_write(&mt, &m, get_clock_ns());
+
 		// =====
 		// HALT/QUIT
 		// =====
 
+		// Headless runs end at halt; any run can end at its instruction budget
+		if ((headless && m.halt && tiles_halted(tiles, tile_count - 1)) ||
+				(max_ins && m.ins_count - first_ins >= max_ins))
+			running = false;
+
 		// Calculate average speed and print when either halted or quitting
-		if ((halt || !running) && !avg_speed_done) {
-			coredump(sim_state, DEBUG_COREDUMP_START, DEBUG_COREDUMP_END);
+		if ((m.halt || !running) && !avg_speed_done) {
+			coredump(stdout, sim_state, DEBUG_COREDUMP_START,
+				DEBUG_COREDUMP_END);
 			avg_speed_done = true;
 			unsigned long long diff = get_clock_ns() - start_time;
 			double diff_s = (double)diff / 1000000000;
-			double avg_speed = (double)ins_count / diff_s;
+			double avg_speed = (double)(m.ins_count - first_ins) / diff_s;
 			printf("Processed %llu instructions in %f seconds.\n"
-				"Average speed: %f Mhz.\n", ins_count, diff_s,
+				"Average speed: %f Mhz.\n", m.ins_count - first_ins, diff_s,
 				avg_speed / 1000000);
+			if (virtual_time) {
+				printf("Virtual time: %llu frames, %f emulated seconds.\n",
+					m.frames, (double)m.frames * FRAME_INTERVAL /
+					1000000000);
+			}
+			if (arg_flag(argc, argv, "-state-hash"))
+				printf("State hash: %016llx\n",
+					(unsigned long long)state_hash(&hasher, &m));
+			if (dbg.cov) {
+				coverage_summary(stdout, dbg.cov);
+				if (!coverage_save(coverage_path, dbg.cov))
+					perror("Cannot write coverage");
+			}
 		}
 	}
 
@@ -962,14 +3696,211 @@ int our_main(int argc, char** argv) {
 	// END MAIN LOOP
 	// =====
 
+	// Report keyboard input, for interactive programs
+	if (m.keys.queued || m.keys.dropped) {
+		printf("Keys: %llu queued, %llu dropped, %d still waiting.\n",
+			m.keys.queued, m.keys.dropped, m.keys.count);
+	}
+	if (m.keys.latency_count) {
+		printf("Keypress to $FF latency over %llu keys: average %f us, "
+			"max %f us.\n", m.keys.latency_count,
+			(double)m.keys.latency_total / m.keys.latency_count / 1000,
+			(double)m.keys.latency_max / 1000);
+	}
+
+	// Handle command line: -record [file]
+	if (rec) {
+		if (!recorder_close(rec)) perror("Cannot write recording");
+		printf("Recorded %llu frames, dropped %llu.\n", rec->written,
+			rec->dropped);
+		free(rec);
+	}
+
+	// Handle command line: -timing
+	if (tm) {
+		printf("%-16s %10s %10s %10s %10s\n", "Timing (us)", "p50", "p99",
+			"max", "count");
+		hist_print(stdout, &tm->jitter);
+		hist_print(stdout, &tm->emulate);
+		hist_print(stdout, &tm->render);
+		hist_print(stdout, &tm->present);
+		hist_print(stdout, &tm->poll);
+		free(tm);
+		if (first_ins_time)
+			printf("Startup: first instruction after %f ms.\n", (double)(
+				first_ins_time - launch_time) / 1000000);
+		if (first_frame_time)
+			printf("Startup: first frame after %f ms.\n", (double)(
+				first_frame_time - launch_time) / 1000000);
+	}
+
+	// Last metrics line, for whatever is left of the period
+	if (mt.fp) {
+		metrics_write(&mt, &m, get_clock_ns());
+		if (mt.fp) fclose(mt.fp);
+	}
+
+	// Save coverage again, with anything run since the halt
+	if (dbg.cov) {
+		if (!coverage_save(coverage_path, dbg.cov))
+			perror("Cannot write coverage");
+		free(dbg.cov);
+	}
+
 	// Close debug difflog
-	if (DEBUG_DIFFLOG) {
-		fclose(difflog_fp);
-		free(difflog_prev_mem);
+	if (dbg.difflog_fp) {
+		fclose(dbg.difflog_fp);
+		free(dbg.difflog_prev_mem);
 	}
 
+	// Close hash logs
+	if (hl.fp) fclose(hl.fp);
+	if (hl.check_fp) fclose(hl.check_fp);
+
+	// Close debugger console
+	if (con.in) console_close(&con);
+
+	// Handle command line: -save [file]
+	if (arg_value(argc, argv, "-save") &&
+			!save_snapshot(arg_value(argc, argv, "-save"), &m))
+		perror("Cannot write snapshot");
+
+	// Close rewind buffer
+	if (rewind_arg) rewind_free(&rw);
+
+	// Close input scripts
+	if (record_fp) fclose(record_fp);
+	free(script.events);
+
 	// Close OS layer
-	os_close();
+	if (!headless) os_close();
+	map_free(&map);
+	image_unmap(image, m.mem);
+	free(m.dirty);
+	free(breaks);
+	free(watched_opcodes);
+	free(logged_opcodes);
+	free(hooks);
+	for (int i = 0; i < tile_count - 1; i++) tile_free(&tiles[i]);
+	free(tiles);
+	images_free(images);
+
+	return 0;
+}
+
+#ifdef FUZZ
+// =====
+// FUZZING
+// =====
+
+// libFuzzer entry point, built with -DFUZZ in place of an OS layer (see
+// build-fuzz.sh). Each input runs on two machines, one with the plain run
+// loop and one with the debug run loop and watched address modes, and any
+// difference between them is a crash. With FUZZ_BIN set, the input is keys
+// for that program; otherwise it is the program.
+#define FUZZ_BUDGET 100000 // Instructions per input
+#define FUZZ_KEY_EVERY 1000 // Instructions between keys
+#define FUZZ_SEED 0x6502
+
+void os_create_window(const char *name, int width, int height) {}
+void os_create_colormap(const float *rgb, int length) {}
+bool os_choose_bin(char *path, int pathLength) { return false; }
+bool os_should_exit(void) { return true; }
+bool os_poll_event(struct event *ev) { return false; }
+bool os_event_pending(void) { return false; }
+void os_wait_event(unsigned long long ns) {}
+void os_wake(void) {}
+void os_draw_rect(int x, int y, int w, int h, const float *rgb, int color) {}
+void os_present(void) {}
+void os_close(void) {}
 
+// Puts a machine back how the image started, copying back only the pages
+// written since (the stack and $FE/$FF are written without marking theirs)
+void fuzz_reset(struct tile *t) {
+	t->m.dirty[0] = t->m.dirty[1] = 1;
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		if (!t->m.dirty[p]) continue;
+		memcpy(t->m.mem + p * PAGE_SIZE, t->image->data + p * PAGE_SIZE,
+			PAGE_SIZE);
+		t->m.dirty[p] = 0;
+	}
+	t->m = (struct machine){ .pc = PC_START, .sp = 0xFF,
+		.rng_state = FUZZ_SEED, .mem = t->m.mem, .dirty = t->m.dirty };
+}
+
+// Same registers, counts and memory? Only pages either one wrote can differ.
+bool fuzz_same(const struct machine *a, const struct machine *b) {
+	if (a->pc != b->pc || a->ac != b->ac || a->x != b->x || a->y != b->y ||
+			a->sr != b->sr || a->sp != b->sp || a->halt != b->halt ||
+			a->ins_count != b->ins_count || a->rng_state != b->rng_state)
+		return false;
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		if ((p < 2 || a->dirty[p] || b->dirty[p]) && memcmp(a->mem +
+				p * PAGE_SIZE, b->mem + p * PAGE_SIZE, PAGE_SIZE) != 0)
+			return false;
+	}
+	return true;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static bool ready = false;
+	static struct image *images = NULL;
+	static struct opcode opcodes[0x100];
+	static struct opcode watched_opcodes[0x100];
+	static struct tile plain, checked;
+	static struct coverage cov;
+	static struct breakpoints breaks;
+	static const char *bin;
+	if (!ready) {
+		construct_opcodes_table(opcodes);
+		opcodes[0xCB] = (struct opcode){ ins_WAI, &addr_impl }; // -timer
+		construct_watched_opcodes_table(watched_opcodes, opcodes);
+		bin = getenv("FUZZ_BIN");
+		struct image *image = image_get(&images, bin ? bin : "/dev/null",
+			LOAD_START);
+		if (!image || !tile_load(&plain, image, FUZZ_SEED, NULL, true) ||
+				!tile_load(&checked, image, FUZZ_SEED, NULL, true)) {
+			perror("Cannot load fuzzing image");
+			abort();
+		}
+		checked.s.cov = &cov; // Something for the watched modes to do
+		checked.s.breaks = &breaks;
+		ready = true;
+	}
+	fuzz_reset(&plain);
+	fuzz_reset(&checked);
+
+	// Input as the program, or as keys for FUZZ_BIN
+	struct tile *both[] = { &plain, &checked };
+	size_t keys = 0;
+	if (!bin) {
+		if (size > TOTAL_MEM - LOAD_START) size = TOTAL_MEM - LOAD_START;
+		for (int i = 0; i < 2; i++) {
+			memcpy(both[i]->m.mem + LOAD_START, data, size);
+			for (size_t p = LOAD_START / PAGE_SIZE;
+					p <= (LOAD_START + size) / PAGE_SIZE && p < PAGE_COUNT; p++)
+				both[i]->m.dirty[p] = 1;
+		}
+	}
+	else keys = size;
+
+	struct debugger dbg = { .breaks = &breaks, .cov = &cov, .out = stderr,
+		.unattended = true };
+	for (unsigned long long at = 0; at < FUZZ_BUDGET; at += FUZZ_KEY_EVERY) {
+		if (at / FUZZ_KEY_EVERY < keys)
+			for (int i = 0; i < 2; i++)
+				key_push(&both[i]->m.keys, both[i]->m.mem,
+					data[at / FUZZ_KEY_EVERY], 0);
+		run_plain(&plain.m, plain.s, opcodes, &dbg, at + FUZZ_KEY_EVERY);
+		run_debug(&checked.m, checked.s, watched_opcodes, &dbg,
+			at + FUZZ_KEY_EVERY);
+		if (!fuzz_same(&plain.m, &checked.m)) {
+			fprintf(stderr, "Run loops disagree by instruction %llu\n",
+				plain.m.ins_count);
+			abort();
+		}
+		if (plain.m.halt) break;
+	}
 	return 0;
 }
+#endif
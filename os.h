@@ -20,7 +20,9 @@
 #include <stdbool.h>
 
 enum event_type { ET_IGNORE, ET_KEYPRESS, ET_EXPOSE };
-struct event { enum event_type type; char kp_key; };
+// time_ns is when the OS layer received the event (same clock as main.c's
+// get_clock_ns), or 0 if the OS layer can't tell
+struct event { enum event_type type; char kp_key; unsigned long long time_ns; };
 
 int our_main(int argc, char **argv);
 
@@ -29,6 +31,9 @@ void os_create_colormap(const float*, int);
 bool os_choose_bin(char*, int);
 bool os_should_exit(void);
 bool os_poll_event(struct event*);
+bool os_event_pending(void);
+void os_wait_event(unsigned long long); // Or until ns pass; 0 = no limit
+void os_wake(void); // Makes os_wait_event return; safe from any thread
 void os_draw_rect(int, int, int, int, const float*, int);
 void os_present(void);
 void os_close(void);
@@ -0,0 +1,71 @@
+# Runs the test binaries and every demo headlessly, in parallel, and compares
+# each one's final state against tests/golden.txt. Run with "update" to
+# rewrite the golden values after an intended change in behaviour.
+EMU=${EMU:-./6502}
+JOBS=${JOBS:-$(nproc)}
+THRESHOLD=${THRESHOLD:-20} # Fail if this many percent slower than baseline
+GOLDEN=tests/golden.txt
+BASELINE=.speed-baseline # Per machine, so not checked in
+
+# A single test, run by xargs below. Prints the golden line with the hash
+# that came out, then the instructions and seconds it took.
+if [[ "$1" == "one" ]]; then
+	read -r file load_at pc budget seed input hash <<< "$2"
+	args="-headless -virtual -unlimited -state-hash -load-at $load_at -pc $pc"
+	args="$args -max-ins $budget -seed $seed"
+	[[ "$input" != "-" ]] && args="$args -input $input"
+	out=$("$EMU" "$file" $args < /dev/null)
+	got=$(sed -n 's/^State hash: //p' <<< "$out")
+	ins=$(sed -n 's/^Processed \([0-9]*\) instructions.*/\1/p' <<< "$out")
+	secs=$(sed -n 's/.* instructions in \([0-9.]*\) seconds.*/\1/p' <<< "$out")
+	echo "$file $load_at $pc $budget $seed $input ${got:-none} ${ins:-0}" \
+		"${secs:-0}"
+	exit
+fi
+
+# Every golden line, plus demos that don't have one yet
+tests=$(grep -v '^#' "$GOLDEN")
+for demo in demos/*.bin; do
+	grep -q "^$demo " <<< "$tests" || tests="$tests
+$demo 0600 0600 5000000 1 - new"
+done
+
+results=$(grep -v '^$' <<< "$tests" |
+	xargs -d '\n' -n 1 -P "$JOBS" bash "$0" one | sort)
+
+if [[ "$1" == "update" ]]; then
+	grep '^#' "$GOLDEN" > "$GOLDEN.new"
+	cut -d ' ' -f 1-7 <<< "$results" >> "$GOLDEN.new"
+	mv "$GOLDEN.new" "$GOLDEN"
+	rm -f "$BASELINE"
+	echo "Updated $GOLDEN."
+fi
+
+# Compare, and report each binary's speed
+failed=0
+while read -r file load_at pc budget seed input got ins secs; do
+	want=$(grep "^$file $load_at $pc $budget $seed $input " <<< "$tests" |
+		cut -d ' ' -f 7)
+	mhz=$(awk "BEGIN { printf \"%.2f\", ($secs > 0 ? $ins / $secs / 1e6 : 0) }")
+	if [[ "$1" == "update" || "$got" == "$want" ]]; then
+		printf "PASS %-28s %10s ins %9ss %8s MHz\n" "$file" "$ins" "$secs" "$mhz"
+	else
+		printf "FAIL %-28s expected %s, got %s\n" "$file" "$want" "$got"
+		failed=1
+	fi
+done <<< "$results"
+
+# Throughput over the whole run, so short demos don't add noise
+mhz=$(awk '{ ins += $8; secs += $9 } END { printf "%.2f", ins / secs / 1e6 }' \
+	<<< "$results")
+echo "Total: $mhz MHz."
+if [[ ! -f "$BASELINE" ]]; then
+	echo "$mhz" > "$BASELINE"
+	echo "Recorded $mhz MHz as this machine's baseline."
+elif awk "BEGIN { exit !($mhz < $(cat "$BASELINE") * (100 - $THRESHOLD) / 100) }"
+then
+	echo "FAIL throughput: $mhz MHz is more than $THRESHOLD% below" \
+		"the baseline of $(cat "$BASELINE") MHz."
+	failed=1
+fi
+exit $failed
@@ -110,6 +110,7 @@ bool os_poll_event(struct event *ev) {
 	if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
 		TranslateMessage(&msg);
 		DispatchMessage(&msg);
+		ev->time_ns = 0; // Unknown
 
 		// Handle event
 		switch (msg.message) {
@@ -138,6 +139,20 @@ bool os_poll_event(struct event *ev) {
 	return false;
 }
 
+bool os_event_pending(void) {
+	return false; // Events are only picked up on I/O frames
+}
+
+void os_wait_event(unsigned long long ns) {
+	// Message stays queued for os_poll_event
+	MsgWaitForMultipleObjects(0, NULL, FALSE,
+		ns ? (DWORD)((ns + 999999) / 1000000) : INFINITE, QS_ALLINPUT);
+}
+
+void os_wake(void) {
+	PostMessage(windowHandle, WM_NULL, 0, 0); // Ends WaitMessage
+}
+
 void os_draw_rect(int x, int y, int w, int h, const float* rgb, int color) {
 	// NOTE: If too slow, extract out into separate function.
 	HDC hdc = GetDC(windowHandle);